@@ -0,0 +1,49 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include <stdint.h>
+
+// Integer color math. The ESP8266 has no FPU, so these avoid float
+// entirely.
+
+// Fixed-point scale for saturation and value: 1.0 == hsv_one
+const uint32_t hsv_one = 1 << 15;
+
+// hue covers the full circle in 0..65535, saturation and value are in
+// 0..hsv_one. Returns 0xRRGGBB and stays within 1 of the float formula
+// per channel.
+uint32_t hsv_to_rgb_fixed(uint16_t hue, uint32_t saturation, uint32_t value);
+
+// Maps a perceived level 0..65535 to the linear LED duty 0..65535 with a
+// gamma of 2.2. The table behind it lives in flash.
+uint16_t gamma_expand(uint16_t level);
+
+// Color wheel of the rainbow and space modes: red at 0, then through blue
+// and green back to red. Reads a table that is generated from
+// rainbow_formula() at build time and lives in flash.
+uint32_t rainbow_color(uint8_t position);
+
+// Moves the channel at shift (16, 8 or 0) of from towards to, weight
+// 0..256 is the share of to
+inline uint32_t blend_channel(uint32_t from, uint32_t to, int shift, int32_t weight)
+{
+  int32_t a = (from >> shift) & 0xFF;
+  int32_t b = (to >> shift) & 0xFF;
+  return (uint32_t)(a + (((b - a) * weight) >> 8)) << shift;
+}
+
+constexpr uint32_t rainbow_formula(uint8_t position)
+{
+  uint32_t wheel_pos = 255 - position;
+  if (wheel_pos < 85)
+    return ((255 - wheel_pos * 3) << 16) | (wheel_pos * 3);
+  if (wheel_pos < 170)
+  {
+    wheel_pos -= 85;
+    return ((wheel_pos * 3) << 8) | (255 - wheel_pos * 3);
+  }
+  wheel_pos -= 170;
+  return ((wheel_pos * 3) << 16) | ((255 - wheel_pos * 3) << 8);
+}
+
+#endif
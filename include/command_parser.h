@@ -0,0 +1,18 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+// In-place parsing of MQTT payloads. The payload is not null terminated, so
+// every function takes the end of the buffer and moves the cursor past what
+// it consumed. Like String::toInt()/toFloat(), a missing number parses as 0.
+
+bool parse_starts_with(const char *cursor, const char *end, const char *prefix);
+bool parse_skip(const char *&cursor, const char *end, char separator);
+bool parse_at_end(const char *&cursor, const char *end);
+// Numbers past parse_int_max saturate at it, far above anything a command
+// accepts, so range checks reject them instead of seeing a wrapped value
+const long parse_int_max = 999999999;
+
+long parse_int(const char *&cursor, const char *end);
+float parse_float(const char *&cursor, const char *end);
+
+#endif
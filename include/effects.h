@@ -0,0 +1,76 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lamp modes, each one is rendered by the effect with the same index in
+// effects[]
+const int MODE_ERROR = 0;
+const int MODE_NORMAL = 1;
+const int MODE_RAINBOW = 2;
+const int MODE_SPACE = 3;
+const int MODE_STROBO = 4;
+const int MODE_PROGRESS = 5;
+const int MODE_FLASH = 6;
+const int MODE_REALTIME = 7;
+const int MODE_SEGMENTS = 8;
+const int effect_count = 9;
+
+enum EffectParameter
+{
+  PARAM_COLOR,
+  PARAM_SPEED,
+  PARAM_ON_PERIOD,
+  PARAM_OFF_PERIOD,
+  PARAM_COUNT,
+  PARAM_PROGRESS,
+};
+
+class Effect
+{
+public:
+  explicit Effect(const char *name) : name(name) {}
+
+  // Called when the lamp switches to this effect
+  virtual void init() {}
+  // Advances the animation by dt ms. Returns false once the effect has
+  // finished and the lamp should return to the previous mode.
+  virtual bool update(unsigned long dt) { return true; }
+  // Draws the current state into count pixels starting at pixels
+  virtual void render(uint32_t *pixels, int count) = 0;
+  // Returns false if the effect has no such parameter or rejects the value
+  virtual bool set_parameter(EffectParameter parameter, int value) { return false; }
+  virtual int get_parameter(EffectParameter parameter) { return 0; }
+
+  // Dims everything the effect draws, for the brightness of a segment
+  void set_brightness(uint8_t brightness) { brightness_scale = brightness + 1; }
+
+  const char *const name;
+
+protected:
+  // Effects pass their colors through here. Red and blue are scaled in one
+  // multiply, the gap of green between them keeps the products apart.
+  uint32_t dim(uint32_t color) const
+  {
+    if (brightness_scale == 256)
+      return color;
+    return ((((color & 0xFF00FF) * brightness_scale) >> 8) & 0xFF00FF) |
+           ((((color & 0x00FF00) * brightness_scale) >> 8) & 0x00FF00);
+  }
+
+private:
+  uint16_t brightness_scale = 256;
+};
+
+extern Effect *const effects[effect_count];
+
+// Room for one instance of any effect that can run in a segment
+const size_t effect_storage_size = 48;
+
+// Builds a fresh instance of the effect of mode, MODE_NORMAL ..
+// MODE_PROGRESS, in storage aligned for an Effect. Returns nullptr for the
+// other modes.
+Effect *effect_construct(int mode, void *storage);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+// Fixed-timestep frame pacing for loop(). Each frame reports the time that
+// elapsed since the previous one, and the scheduler sleeps only for what is
+// left of the frame period once the work is done.
+
+const int target_fps = 100;
+const unsigned long frame_period = 1000 / target_fps;
+// Time the work of one frame may take before it counts as a missed deadline
+const unsigned long frame_budget = frame_period;
+// Upper bound for the elapsed time handed to the effects after a stall
+const unsigned long max_frame_dt = 250;
+
+struct FrameSchedulerStats
+{
+  unsigned long frames;
+  unsigned long missed_deadlines;
+  unsigned long dropped_frames;
+  unsigned long max_frame_time;
+};
+
+void frame_scheduler_begin();
+unsigned long frame_scheduler_start_frame();
+unsigned long frame_scheduler_remaining();
+void frame_scheduler_end_frame();
+const FrameSchedulerStats &frame_scheduler_stats();
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdint.h>
+#include "hal.h"
+
+// Frame the effects render into. framebuffer_show() compares it with the
+// last frame that went out and only pushes it to the strip when a pixel
+// changed, because every pixels.show() blocks interrupts for about 2.6 ms.
+// On the way out every channel is gamma corrected and scaled by the global
+// brightness, so effects render plain sRGB-like colors at full brightness.
+// Finally the frame is scaled down if its estimated current would exceed
+// the power budget; 86 pixels at full white draw about 5 A.
+
+// Default budget of the power limiter, can be set from build_flags
+#ifndef POWER_BUDGET_MA
+#define POWER_BUDGET_MA 2000
+#endif
+
+// WS2812B draw per pixel when dark and per fully lit channel
+const uint32_t pixel_idle_ma = 1;
+const uint32_t channel_full_ma = 20;
+
+struct FrameStats
+{
+  unsigned long pushed;
+  unsigned long skipped;
+  // Time from a local input (switch, rotary encoder) to the next pushed frame
+  unsigned long input_latency_last;
+  unsigned long input_latency_max;
+  // Estimated draw of the last pushed frame before and after limiting
+  uint32_t power_requested_ma;
+  uint32_t power_ma;
+  uint32_t power_max_ma;
+  // Frames the power limiter had to scale down
+  unsigned long power_limited;
+};
+
+extern uint32_t framebuffer[num_pixels];
+
+void framebuffer_fill(uint32_t color);
+void framebuffer_invalidate();
+void framebuffer_set_brightness(uint8_t brightness);
+void framebuffer_fade_brightness(uint8_t brightness, unsigned long duration);
+uint8_t framebuffer_brightness();
+void framebuffer_start_transition(unsigned long duration);
+void framebuffer_set_power_budget(uint32_t budget_ma);
+uint32_t framebuffer_power_budget();
+void framebuffer_mark_input(unsigned long time);
+bool framebuffer_show();
+const FrameStats &framebuffer_stats();
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+// Hardware abstraction used by the lamp logic in main.cpp.
+// src/hal_esp8266.cpp implements it for the d1_mini, src/native/hal_native.cpp
+// provides fakes so the firmware can run on the host.
+
+const int num_pixels = 86;
+
+typedef void (*hal_mqtt_callback_t)(char *topic, uint8_t *payload, unsigned int length);
+
+inline uint32_t pixel_color(uint8_t r, uint8_t g, uint8_t b)
+{
+  return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+// Clock and system
+unsigned long hal_millis();
+void hal_delay(unsigned long ms);
+void hal_feed_watchdog();
+uint32_t hal_random();
+
+// Diagnostics
+uint32_t hal_cycle_count();
+uint32_t hal_cycles_per_us();
+uint32_t hal_free_heap();
+uint32_t hal_max_free_block();
+uint8_t hal_heap_fragmentation();
+const char *hal_reset_reason();
+
+// GPIO
+void hal_gpio_setup();
+void hal_set_status_led(bool on);
+
+// Switch and rotary encoder, reported as events through input_queue
+void hal_input_begin();
+// Reports the level the switch settled on, called every loop
+void hal_input_poll();
+
+// Pixel sink
+void hal_pixels_begin();
+// Both take final 0xRRGGBB colors and only fill the buffer, show sends it
+void hal_pixels_write(const uint32_t *colors);
+void hal_pixels_fill(uint32_t color);
+void hal_pixels_show();
+
+// Small persistent record in flash
+void hal_storage_begin(unsigned int size);
+bool hal_storage_read(void *data, unsigned int size);
+bool hal_storage_write(const void *data, unsigned int size);
+
+// WiFi, connects in the background
+void hal_wifi_begin();
+void hal_wifi_loop();
+bool hal_wifi_connected();
+int8_t hal_wifi_rssi();
+
+// UDP receiver, parse returns the length of the next packet or 0
+void hal_udp_begin(uint16_t port);
+int hal_udp_parse();
+int hal_udp_read(void *data, int size);
+
+// MQTT client
+void hal_mqtt_setup(const char *server_address, uint16_t server_port, hal_mqtt_callback_t callback);
+bool hal_mqtt_connect(const char *id, const char *username, const char *password);
+bool hal_mqtt_connected();
+int hal_mqtt_state();
+bool hal_mqtt_subscribe(const char *topic);
+bool hal_mqtt_publish(const char *topic, const char *payload);
+void hal_mqtt_loop();
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <stdint.h>
+
+// Single-producer, single-consumer ring buffer between the GPIO interrupt
+// handlers (producer) and loop() (consumer). Only the producer writes
+// input_head and only the consumer writes input_tail, so no locking is
+// needed on the single-core ESP8266.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#define INPUT_ISR_ATTR IRAM_ATTR
+#else
+#define INPUT_ISR_ATTR
+#endif
+
+enum InputEventType : uint8_t
+{
+  INPUT_ROTATE,
+  INPUT_SWITCH_PRESSED,
+  INPUT_SWITCH_RELEASED,
+};
+
+struct InputEvent
+{
+  InputEventType type;
+  // Detents turned for INPUT_ROTATE, positive is clockwise
+  int8_t steps;
+  // hal_millis() when the edge was seen
+  uint32_t time;
+};
+
+// Must be a power of two
+const uint8_t input_queue_size = 32;
+
+void input_queue_push(InputEventType type, int8_t steps, uint32_t time);
+bool input_queue_pop(InputEvent &event);
+unsigned long input_queue_overflows();
+
+#endif
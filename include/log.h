@@ -0,0 +1,77 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <Arduino.h>
+
+// Buffered logging. Messages are formatted into a fixed ring buffer and
+// written to Serial (and to the /log topic for remote messages) by
+// log_drain() at the end of each frame, within a time budget. Levels above
+// LOG_LEVEL are compiled out; LOG_TRACE replaces the old DEBUG_WDT prints
+// and writes synchronously, so the last line before a watchdog reset is
+// not lost in the buffer.
+// The macros take a string literal as format and keep it in flash (PSTR),
+// so the messages cost no RAM on the ESP8266.
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+const int log_capacity = 16;
+const int log_message_length = 80;
+// Longest time log_drain() may spend per frame
+const unsigned long log_budget = 2;
+
+struct LogStats
+{
+  unsigned long queued;
+  unsigned long aggregated;
+  unsigned long dropped;
+};
+
+void log_begin(const char *mqtt_topic);
+// format and message point to flash
+void log_message(bool remote, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_trace(const char *message);
+void log_drain(unsigned long budget);
+const LogStats &log_stats();
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) log_message(false, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) log_message(false, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) log_message(false, PSTR(format), ##__VA_ARGS__)
+// Also published on the /log topic
+#define LOG_REMOTE(format, ...) log_message(true, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#define LOG_REMOTE(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) log_message(false, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(message) log_trace(PSTR(message))
+#else
+#define LOG_TRACE(message) ((void)0)
+#endif
+
+#endif
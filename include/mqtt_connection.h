@@ -0,0 +1,44 @@
+#ifndef MQTT_CONNECTION_H
+#define MQTT_CONNECTION_H
+
+// Keeps the MQTT session up without stalling the frame loop. Every call to
+// mqtt_connection_update() does at most one blocking broker operation, so
+// connecting and subscribing are spread over separate frames, and failed
+// attempts back off exponentially with jitter.
+
+const unsigned long mqtt_backoff_min = 1000;
+const unsigned long mqtt_backoff_max = 60000;
+
+enum MqttConnectionEvent
+{
+  MQTT_EVENT_NONE,
+  MQTT_EVENT_CONNECTED,
+  MQTT_EVENT_LOST,
+  // The first attempt of an outage failed, the lamp keeps retrying
+  MQTT_EVENT_FAILED,
+};
+
+struct MqttConnectionStats
+{
+  unsigned long attempts;
+  unsigned long failures;
+  unsigned long connects;
+  // Duration of the blocking connect and subscribe calls
+  unsigned long connect_time_last;
+  unsigned long connect_time_max;
+  // Of the last subscription
+  unsigned long subscribe_time_last;
+  // Total time without a usable session, including the current outage
+  unsigned long disconnected_time;
+  unsigned long backoff;
+};
+
+// The session subscribes to each of the count topics in subscriptions,
+// one per update
+void mqtt_connection_begin(const char *id, const char *username, const char *password,
+                           const char *const *subscriptions, int count);
+MqttConnectionEvent mqtt_connection_update();
+bool mqtt_connection_ready();
+const MqttConnectionStats &mqtt_connection_stats();
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Minimal stand-in for the parts of the Arduino core that main.cpp uses,
+// so the firmware logic compiles for the native environment.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+
+typedef uint8_t byte;
+
+// The host has no separate flash address space
+#define PROGMEM
+#define PSTR(str) (str)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define vsnprintf_P vsnprintf
+#define snprintf_P snprintf
+#define strncpy_P strncpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class HardwareSerial
+{
+public:
+  void begin(unsigned long) {}
+
+  int availableForWrite() { return 128; }
+
+  void write(const uint8_t *buffer, size_t size)
+  {
+    if (!quiet)
+      fwrite(buffer, 1, size, stdout);
+  }
+
+  void print(const char *str) { write((const uint8_t *)str, strlen(str)); }
+  void print(char c) { write((const uint8_t *)&c, 1); }
+  void print(int number) { print((long)number); }
+  void print(unsigned int number) { print((unsigned long)number); }
+  void print(long number) { print(std::to_string(number).c_str()); }
+  void print(unsigned long number) { print(std::to_string(number).c_str()); }
+  void print(double number)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.2f", number);
+    print(buffer);
+  }
+
+  template <typename T>
+  void println(T value)
+  {
+    print(value);
+    println();
+  }
+  void println() { print("\r\n"); }
+
+  // Set by the simulator to silence output during benchmarks
+  bool quiet = false;
+};
+
+extern HardwareSerial Serial;
+
+void setup();
+void loop();
+
+#endif
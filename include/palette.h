@@ -0,0 +1,43 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+#include "color.h"
+
+// Colors of the effects that walk along a gradient (rainbow, space).
+// Palette 0 is the built-in color wheel in flash. Gradients uploaded over
+// MQTT go into the slots 1..palette_slots and are compiled into a
+// 256-entry table once, so selecting a cached palette costs nothing and
+// rendering stays one lookup per pixel. A slot takes its 1 KB of RAM on
+// the first upload.
+
+const int palette_slots = 3;
+const int palette_max_stops = 16;
+
+struct PaletteStop
+{
+  uint8_t position;
+  uint32_t color;
+};
+
+// Table of the selected palette, nullptr for the built-in one
+extern const uint32_t *palette_table;
+
+// Compiles stops, sorted by position, into the table of slot and selects
+// it. Colors before the first and after the last stop are held, two stops
+// at the same position make a hard edge. Returns false and changes
+// nothing if the slot or the stops are invalid or the table does not fit
+// into the heap.
+bool palette_compile(int slot, const PaletteStop *stops, int count);
+// False if the slot is out of range or was never uploaded
+bool palette_available(int slot);
+// Returns false and keeps the current palette if the slot is not available
+bool palette_select(int slot);
+int palette_selected();
+
+inline uint32_t palette_color(uint8_t index)
+{
+  return palette_table ? palette_table[index] : rainbow_color(index);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef PERSISTENCE_H
+#define PERSISTENCE_H
+
+#include <stdint.h>
+
+// Keeps the lamp state in flash so it survives a power cycle. The state is
+// handed in every frame; it is only written once it has stopped changing
+// for persist_quiet_period, so spinning the knob or a burst of MQTT
+// commands ends up as a single write.
+
+const unsigned long persist_quiet_period = 5000;
+
+struct PersistentState
+{
+  uint32_t color;
+  uint16_t rainbow_speed;
+  uint16_t space_speed;
+  uint16_t strobo_on;
+  uint16_t strobo_off;
+  uint8_t mode;
+  uint8_t brightness;
+  // Keeps the struct free of padding, so it can be compared with memcmp
+  uint8_t reserved[2];
+};
+
+struct PersistenceStats
+{
+  unsigned long writes;
+  unsigned long bytes_written;
+  unsigned long write_errors;
+  // State changes that were folded into a later write
+  unsigned long coalesced;
+};
+
+// Returns false if nothing valid was stored yet
+bool persistence_load(PersistentState &state);
+void persistence_update(const PersistentState &state);
+const PersistenceStats &persistence_stats();
+
+#endif
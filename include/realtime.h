@@ -0,0 +1,54 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdint.h>
+
+// Realtime pixel streaming over UDP with the Distributed Display Protocol
+// (DDP), as sent by xLights, WLED or tools/ddp_send.py, or as binary
+// payloads on the <root>/frame MQTT topic. Frames are decoded straight into
+// the frame buffer; the lamp switches to MODE_REALTIME with the first one
+// and falls back to the previous mode when the stream stops.
+
+const uint16_t ddp_port = 4048;
+// Stream silence after which the lamp leaves the realtime mode
+const unsigned long realtime_timeout = 2500;
+// Upper bound of packets handled per frame, the rest waits for the next one
+const int realtime_packets_per_frame = 8;
+
+struct RealtimeStats
+{
+  unsigned long received;
+  // Complete frames that were pushed to the strip
+  unsigned long shown;
+  // Complete frames replaced by a newer one before they could be shown
+  unsigned long dropped;
+  // Packets that arrived after a newer one of the stream
+  unsigned long late;
+  // Packets that are not DDP pixel data for this strip
+  unsigned long invalid;
+};
+
+void realtime_begin();
+enum RealtimeEvent
+{
+  REALTIME_EVENT_NONE,
+  // Pixels of a frame arrived, the packet with the push flag is still due
+  REALTIME_EVENT_PIXELS,
+  // A frame was completed, by a packet with the push flag or an MQTT frame
+  REALTIME_EVENT_FRAME,
+};
+
+// Reads the pending packets into pixels. The lamp has to stop rendering
+// into pixels with the first event, or it would overwrite the part of the
+// frame that already arrived.
+RealtimeEvent realtime_poll(uint32_t *pixels, int count);
+// Decodes a <root>/frame payload: either 3 bytes RGB for every pixel, or
+// runs of 4 bytes [count, r, g, b] starting at the first pixel, with the
+// pixels after the last run turned off. Returns false if the payload is
+// neither.
+bool realtime_decode_frame(const uint8_t *payload, int length, uint32_t *pixels, int count);
+void realtime_frame_shown();
+unsigned long realtime_last_packet();
+const RealtimeStats &realtime_stats();
+
+#endif
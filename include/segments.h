@@ -0,0 +1,38 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <stdint.h>
+#include "effects.h"
+
+// Splits the strip into segments that follow each other from pixel 0 up,
+// each with its own instance of an effect, e.g. progress on the bottom
+// third and a rainbow above it. MODE_SEGMENTS renders them all into one
+// frame, so every pixel is still drawn once and the strip is pushed once.
+// Pixels past the last segment stay dark. The layout lives in RAM only.
+
+const int segment_max_count = 6;
+
+struct SegmentConfig
+{
+  int length;
+  // One of MODE_NORMAL .. MODE_PROGRESS
+  int mode;
+  // Passed to the effect if it has such a parameter, 0 keeps its default
+  // speed. For a strobo the speed is the time between flashes in ms.
+  int color;
+  int speed;
+  // Of the segment, on top of the global brightness
+  int brightness;
+};
+
+// Replaces the layout and restarts the effects of all segments. Returns
+// false and keeps the current layout if a segment is invalid or they do
+// not fit on the strip.
+bool segments_configure(const SegmentConfig *configs, int count);
+int segments_count();
+// Hands the value to every segment whose effect has the parameter
+void segments_set_parameter(EffectParameter parameter, int value);
+void segments_update(unsigned long dt);
+void segments_render(uint32_t *pixels, int count);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lookup tables that the compiler fills in at build time. Define one from
+// a constexpr formula, e.g.
+//   static constexpr Table<uint16_t, 257> gamma_table PROGMEM = make_table<uint16_t, 257>(gamma_entry);
+// and it lands in flash without any code at boot or RAM at runtime. Read
+// it with table_read(), the ESP8266 can only fetch aligned words from flash.
+
+template <typename T, size_t N>
+struct Table
+{
+  T values[N];
+
+  static constexpr size_t size() { return N; }
+};
+
+template <typename T, size_t N, typename Formula>
+constexpr Table<T, N> make_table(Formula formula)
+{
+  Table<T, N> table = {};
+  for (size_t i = 0; i < N; i++)
+    table.values[i] = formula(i);
+  return table;
+}
+
+template <size_t N>
+inline uint8_t table_read(const Table<uint8_t, N> &table, size_t index)
+{
+  return pgm_read_byte(&table.values[index]);
+}
+
+template <size_t N>
+inline uint16_t table_read(const Table<uint16_t, N> &table, size_t index)
+{
+  return pgm_read_word(&table.values[index]);
+}
+
+template <size_t N>
+inline uint32_t table_read(const Table<uint32_t, N> &table, size_t index)
+{
+  return pgm_read_dword(&table.values[index]);
+}
+
+// Math for the formulas, <math.h> is not usable in constant expressions.
+// Accurate to about 1e-15 relative over the range the tables need.
+
+constexpr double constexpr_exp(double x)
+{
+  // exp(x) = 2^k * exp(r) with |r| <= ln(2) / 2
+  const double ln2 = 0.69314718055994530942;
+  int k = (int)(x / ln2 + (x < 0 ? -0.5 : 0.5));
+  double r = x - k * ln2;
+  double term = 1;
+  double sum = 1;
+  for (int n = 1; n < 30; n++)
+  {
+    term *= r / n;
+    sum += term;
+  }
+  for (; k > 0; k--)
+    sum *= 2;
+  for (; k < 0; k++)
+    sum /= 2;
+  return sum;
+}
+
+constexpr double constexpr_log(double x)
+{
+  // x = m * 2^k with m in [1, 2), ln(m) = 2 * atanh((m - 1) / (m + 1))
+  const double ln2 = 0.69314718055994530942;
+  int k = 0;
+  while (x >= 2)
+  {
+    x /= 2;
+    k++;
+  }
+  while (x < 1)
+  {
+    x *= 2;
+    k--;
+  }
+  double z = (x - 1) / (x + 1);
+  double z2 = z * z;
+  double power = z;
+  double sum = 0;
+  for (int n = 1; n < 60; n += 2)
+  {
+    sum += power / n;
+    power *= z2;
+  }
+  return 2 * sum + k * ln2;
+}
+
+constexpr double constexpr_pow(double base, double exponent)
+{
+  return base <= 0 ? 0 : constexpr_exp(exponent * constexpr_log(base));
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+
+// Hot-path timing from the CPU cycle counter. Every section keeps a count,
+// the sum and maximum and a histogram with fixed bucket bounds; recording
+// one measurement is a subtraction, a division and a short bucket scan.
+// telemetry_format() writes everything as JSON and starts the next interval.
+
+enum TelemetrySection
+{
+  SECTION_LOOP,
+  SECTION_INPUT,
+  SECTION_RENDER,
+  SECTION_SHOW,
+  SECTION_MQTT,
+  SECTION_CALLBACK,
+  section_count,
+};
+
+const int histogram_buckets = 8;
+// Upper bounds in us of all buckets but the last one, which is open
+const uint32_t histogram_bounds[histogram_buckets - 1] = {100, 250, 500, 1000, 2500, 5000, 10000};
+// RSSI samples kept for the trend, one per telemetry_format()
+const int rssi_history = 8;
+
+inline uint32_t telemetry_start()
+{
+  return hal_cycle_count();
+}
+
+void telemetry_end(TelemetrySection section, uint32_t start);
+// Appends the statistics as JSON members (no braces) to buffer and resets
+// the timings. Returns the number of characters written.
+size_t telemetry_format(char *buffer, size_t size);
+
+#endif
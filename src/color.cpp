@@ -0,0 +1,72 @@
+#include <Arduino.h>
+#include "color.h"
+#include "tables.h"
+
+// round(65535 * (i / 256)^2.2) for i = 0..256, the extra entry is the end
+// point for interpolating the last step
+constexpr uint16_t gamma_entry(size_t i)
+{
+  return constexpr_pow(i / 256.0, 2.2) * 65535 + 0.5;
+}
+
+static constexpr Table<uint16_t, 257> gamma_table PROGMEM = make_table<uint16_t, 257>(gamma_entry);
+static constexpr Table<uint32_t, 256> rainbow_table PROGMEM = make_table<uint32_t, 256>(rainbow_formula);
+
+uint32_t hsv_to_rgb_fixed(uint16_t hue, uint32_t saturation, uint32_t value)
+{
+  if (saturation > hsv_one)
+    saturation = hsv_one;
+  if (value > hsv_one)
+    value = hsv_one;
+
+  // Split the circle into six 60 degree sectors with a Q15 position inside
+  uint32_t hue6 = (uint32_t)hue * 6;
+  uint32_t sector = hue6 >> 16;
+  uint32_t fraction = (hue6 & 0xFFFF) >> 1;
+
+  uint32_t c = (value * saturation) >> 15;
+  uint32_t x = (c * ((sector & 1) ? hsv_one - fraction : fraction)) >> 15;
+  uint32_t m = value - c;
+
+  uint32_t r, g, b;
+  switch (sector)
+  {
+  case 0:
+    r = c, g = x, b = 0;
+    break;
+  case 1:
+    r = x, g = c, b = 0;
+    break;
+  case 2:
+    r = 0, g = c, b = x;
+    break;
+  case 3:
+    r = 0, g = x, b = c;
+    break;
+  case 4:
+    r = x, g = 0, b = c;
+    break;
+  default:
+    r = c, g = 0, b = x;
+    break;
+  }
+
+  r = ((r + m) * 255) >> 15;
+  g = ((g + m) * 255) >> 15;
+  b = ((b + m) * 255) >> 15;
+  return (r << 16) | (g << 8) | b;
+}
+
+uint16_t gamma_expand(uint16_t level)
+{
+  uint16_t index = level >> 8;
+  uint32_t fraction = level & 0xFF;
+  uint32_t low = table_read(gamma_table, index);
+  uint32_t high = table_read(gamma_table, index + 1);
+  return low + (((high - low) * fraction) >> 8);
+}
+
+uint32_t rainbow_color(uint8_t position)
+{
+  return table_read(rainbow_table, position);
+}
@@ -0,0 +1,85 @@
+#include <string.h>
+#include "command_parser.h"
+
+static void skip_blanks(const char *&cursor, const char *end)
+{
+  while (cursor < end && (*cursor == ' ' || *cursor == '\t'))
+    cursor++;
+}
+
+static bool parse_sign(const char *&cursor, const char *end)
+{
+  bool negative = false;
+  if (cursor < end && (*cursor == '-' || *cursor == '+'))
+  {
+    negative = *cursor == '-';
+    cursor++;
+  }
+  return negative;
+}
+
+bool parse_starts_with(const char *cursor, const char *end, const char *prefix)
+{
+  size_t prefix_length = strlen(prefix);
+  return (size_t)(end - cursor) >= prefix_length && memcmp(cursor, prefix, prefix_length) == 0;
+}
+
+// Moves the cursor past the next occurrence of separator, returns false if there is none
+bool parse_skip(const char *&cursor, const char *end, char separator)
+{
+  const char *found = (const char *)memchr(cursor, separator, end - cursor);
+  if (!found)
+    return false;
+  cursor = found + 1;
+  return true;
+}
+
+// Skips blanks, returns true if nothing else is left
+bool parse_at_end(const char *&cursor, const char *end)
+{
+  skip_blanks(cursor, end);
+  return cursor == end;
+}
+
+long parse_int(const char *&cursor, const char *end)
+{
+  skip_blanks(cursor, end);
+  bool negative = parse_sign(cursor, end);
+  long value = 0;
+  while (cursor < end && *cursor >= '0' && *cursor <= '9')
+  {
+    // Checked before the multiply, long has only 32 bits on the ESP8266.
+    // The remaining digits are still consumed.
+    int digit = *cursor - '0';
+    if (value > (parse_int_max - digit) / 10)
+      value = parse_int_max;
+    else
+      value = value * 10 + digit;
+    cursor++;
+  }
+  return negative ? -value : value;
+}
+
+float parse_float(const char *&cursor, const char *end)
+{
+  skip_blanks(cursor, end);
+  bool negative = parse_sign(cursor, end);
+  float value = 0;
+  while (cursor < end && *cursor >= '0' && *cursor <= '9')
+  {
+    value = value * 10 + (*cursor - '0');
+    cursor++;
+  }
+  if (cursor < end && *cursor == '.')
+  {
+    cursor++;
+    float scale = 0.1f;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9')
+    {
+      value += (*cursor - '0') * scale;
+      scale *= 0.1f;
+      cursor++;
+    }
+  }
+  return negative ? -value : value;
+}
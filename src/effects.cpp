@@ -0,0 +1,448 @@
+#include <new>
+#include "effects.h"
+#include "color.h"
+#include "frame_scheduler.h"
+#include "palette.h"
+#include "hal.h"
+#include "realtime.h"
+#include "segments.h"
+#include "tables.h"
+
+// Moves a wheel position on by the steps of step_period ms that fit into
+// dt. Periods shorter than a frame advance one step per frame.
+static int advance_wheel(int wheel_pos, unsigned long &wheel_time, unsigned long dt, int step_period)
+{
+  if (step_period < (int)frame_period)
+    step_period = frame_period;
+  wheel_time += dt;
+  // Most frames are shorter than a step, skip the divide for them
+  if (wheel_time < (unsigned long)step_period)
+    return wheel_pos;
+  int steps = wheel_time / step_period;
+  wheel_time %= step_period;
+  return (wheel_pos + steps) % 256;
+}
+
+// Returns true at most once per frame when the timer has run for period ms
+static bool advance_timer(unsigned long &timer, unsigned long dt, int period)
+{
+  timer += dt;
+  if (timer < (unsigned long)period)
+    return false;
+  timer -= period;
+  if (timer >= (unsigned long)period)
+    timer = 0;
+  return true;
+}
+
+static void fill(uint32_t *pixels, int count, uint32_t color)
+{
+  for (int i = 0; i < count; i++)
+  {
+    pixels[i] = color;
+  }
+}
+
+// Position of each pixel along the full strip in 1/256, so spatial effects
+// need no divide per pixel
+constexpr uint8_t strip_phase_formula(size_t i)
+{
+  return i * 256 / num_pixels;
+}
+
+static constexpr Table<uint8_t, num_pixels> strip_phase PROGMEM =
+    make_table<uint8_t, num_pixels>(strip_phase_formula);
+
+static uint32_t color_from_int(int color)
+{
+  return pixel_color(color / (256 * 256), (color / 256) % 256, color % 256);
+}
+
+class ErrorEffect : public Effect
+{
+public:
+  ErrorEffect() : Effect("ERROR") {}
+
+  bool update(unsigned long dt) override
+  {
+    wheel_pos = advance_wheel(wheel_pos, wheel_time, dt, wheel_speed);
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    uint32_t color;
+    if (wheel_pos < 127)
+    {
+      color = pixel_color(wheel_pos, 0, 0);
+    }
+    else
+    {
+      color = pixel_color(255 - wheel_pos, 0, 0);
+    }
+    fill(pixels, count, color);
+  }
+
+private:
+  static const int wheel_speed = 5;
+  unsigned long wheel_time = 0;
+  int wheel_pos = 0;
+};
+
+class ColorEffect : public Effect
+{
+public:
+  ColorEffect() : Effect("NORMAL") {}
+
+  void render(uint32_t *pixels, int count) override
+  {
+    fill(pixels, count, dim(color_from_int(color)));
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (parameter != PARAM_COLOR)
+      return false;
+    color = value;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    return parameter == PARAM_COLOR ? color : 0;
+  }
+
+private:
+  int color = 0;
+};
+
+class RainbowEffect : public Effect
+{
+public:
+  RainbowEffect() : Effect("RAINBOW") {}
+
+  bool update(unsigned long dt) override
+  {
+    wheel_pos = advance_wheel(wheel_pos, wheel_time, dt, wheel_speed);
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    fill(pixels, count, dim(palette_color(wheel_pos)));
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (parameter != PARAM_SPEED || value <= 0)
+      return false;
+    wheel_speed = value;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    return parameter == PARAM_SPEED ? wheel_speed : 0;
+  }
+
+private:
+  int wheel_speed = 20;
+  unsigned long wheel_time = 0;
+  int wheel_pos = 0;
+};
+
+class SpaceEffect : public Effect
+{
+public:
+  SpaceEffect() : Effect("SPACE") {}
+
+  bool update(unsigned long dt) override
+  {
+    wheel_pos = advance_wheel(wheel_pos, wheel_time, dt, wheel_speed);
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    uint8_t offset = wheel_pos * 2;
+    if (count == num_pixels)
+    {
+      for (int i = 0; i < count; i++)
+      {
+        pixels[i] = dim(palette_color(offset + table_read(strip_phase, i)));
+      }
+      return;
+    }
+    // A segment steps through i * 256 / count in 16.16 fixed point instead
+    // of dividing per pixel. Rounding the step up keeps it exact for count
+    // up to 256.
+    uint32_t step = ((256 << 16) + count - 1) / count;
+    uint32_t phase = 0;
+    for (int i = 0; i < count; i++)
+    {
+      pixels[i] = dim(palette_color(offset + (phase >> 16)));
+      phase += step;
+    }
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (parameter != PARAM_SPEED || value <= 0)
+      return false;
+    wheel_speed = value;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    return parameter == PARAM_SPEED ? wheel_speed : 0;
+  }
+
+private:
+  int wheel_speed = 1;
+  unsigned long wheel_time = 0;
+  int wheel_pos = 0;
+};
+
+class StroboEffect : public Effect
+{
+public:
+  StroboEffect() : Effect("STROBO") {}
+
+  bool update(unsigned long dt) override
+  {
+    if (advance_timer(strobo_time, dt, strobo_state ? on_period : off_period))
+      strobo_state = !strobo_state;
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    uint32_t color = pixel_color(0, 0, 0);
+    if (strobo_state)
+      color = pixel_color(255, 255, 255);
+    fill(pixels, count, dim(color));
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (value <= 0)
+      return false;
+    if (parameter == PARAM_ON_PERIOD)
+      on_period = value;
+    // The speed of a strobo is the dark time between its flashes
+    else if (parameter == PARAM_OFF_PERIOD || parameter == PARAM_SPEED)
+      off_period = value;
+    else
+      return false;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    if (parameter == PARAM_ON_PERIOD)
+      return on_period;
+    if (parameter == PARAM_OFF_PERIOD || parameter == PARAM_SPEED)
+      return off_period;
+    return 0;
+  }
+
+private:
+  int on_period = 8;
+  int off_period = 100;
+  unsigned long strobo_time = 0;
+  bool strobo_state = false;
+};
+
+class ProgressEffect : public Effect
+{
+public:
+  ProgressEffect() : Effect("PROGRESS") {}
+
+  bool update(unsigned long dt) override
+  {
+    wheel_pos = advance_wheel(wheel_pos, wheel_time, dt, wheel_speed);
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    int num_green_leds = count * progress / 100;
+    int wave_pos = 0;
+    if (num_green_leds > 0)
+      wave_pos = wheel_pos % num_green_leds;
+    // 255 / count in 16.16 fixed point, so the falloff below needs one
+    // multiply per pixel instead of a divide. Rounding the product up makes
+    // it exactly 255 * (count - gap) / count for count up to 256.
+    uint32_t falloff_step = (255 << 16) / count;
+    for (int i = 0; i < num_green_leds; i++)
+    {
+      int gap_to_wave = wave_pos - i;
+      if (gap_to_wave < 0)
+        gap_to_wave = num_green_leds + gap_to_wave;
+      int green_val = 255 - (int)((gap_to_wave * falloff_step + 0xFFFF) >> 16);
+      pixels[i] = dim(pixel_color(0, green_val, 0));
+    }
+    fill(pixels + num_green_leds, count - num_green_leds, dim(pixel_color(255, 0, 0)));
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (parameter != PARAM_PROGRESS)
+      return false;
+    if (value < 0)
+      value = 0;
+    if (value > 100)
+      value = 100;
+    progress = value;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    return parameter == PARAM_PROGRESS ? progress : 0;
+  }
+
+private:
+  static const int wheel_speed = 20;
+  unsigned long wheel_time = 0;
+  int wheel_pos = 0;
+  int progress = 0;
+};
+
+class FlashEffect : public Effect
+{
+public:
+  FlashEffect() : Effect("FLASH") {}
+
+  void init() override
+  {
+    flash_time = 0;
+    flash_state = false;
+  }
+
+  bool update(unsigned long dt) override
+  {
+    if (advance_timer(flash_time, dt, flash_speed))
+    {
+      flash_state = !flash_state;
+      if (flash_state)
+        flash_count--;
+    }
+    // Finish after the off phase of the last flash
+    return flash_count > 0 || flash_state;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    fill(pixels, count, flash_state ? color_from_int(flash_color) : 0);
+  }
+
+  bool set_parameter(EffectParameter parameter, int value) override
+  {
+    if (parameter == PARAM_COLOR)
+      flash_color = value;
+    else if (parameter == PARAM_COUNT)
+      flash_count = value;
+    else
+      return false;
+    return true;
+  }
+
+  int get_parameter(EffectParameter parameter) override
+  {
+    if (parameter == PARAM_COLOR)
+      return flash_color;
+    if (parameter == PARAM_COUNT)
+      return flash_count;
+    return 0;
+  }
+
+private:
+  static const int flash_speed = 200;
+  static const int start_flash_count = 5;
+  unsigned long flash_time = 0;
+  int flash_count = start_flash_count;
+  int flash_color = 0;
+  bool flash_state = false;
+};
+
+// Shows what the UDP stream wrote into the frame buffer, see realtime.h
+class RealtimeEffect : public Effect
+{
+public:
+  RealtimeEffect() : Effect("REALTIME") {}
+
+  bool update(unsigned long dt) override
+  {
+    return hal_millis() - realtime_last_packet() < realtime_timeout;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+  }
+};
+
+// Renders the layout of segments.h
+class SegmentsEffect : public Effect
+{
+public:
+  SegmentsEffect() : Effect("SEGMENTS") {}
+
+  bool update(unsigned long dt) override
+  {
+    segments_update(dt);
+    return true;
+  }
+
+  void render(uint32_t *pixels, int count) override
+  {
+    segments_render(pixels, count);
+  }
+};
+
+static ErrorEffect error_effect;
+static ColorEffect color_effect;
+static RainbowEffect rainbow_effect;
+static SpaceEffect space_effect;
+static StroboEffect strobo_effect;
+static ProgressEffect progress_effect;
+static FlashEffect flash_effect;
+static RealtimeEffect realtime_effect;
+static SegmentsEffect segments_effect;
+
+Effect *const effects[effect_count] = {
+    &error_effect,
+    &color_effect,
+    &rainbow_effect,
+    &space_effect,
+    &strobo_effect,
+    &progress_effect,
+    &flash_effect,
+    &realtime_effect,
+    &segments_effect,
+};
+
+static_assert(sizeof(ColorEffect) <= effect_storage_size && sizeof(RainbowEffect) <= effect_storage_size &&
+                  sizeof(SpaceEffect) <= effect_storage_size && sizeof(StroboEffect) <= effect_storage_size &&
+                  sizeof(ProgressEffect) <= effect_storage_size,
+              "effect_storage_size is too small");
+
+Effect *effect_construct(int mode, void *storage)
+{
+  switch (mode)
+  {
+  case MODE_NORMAL:
+    return new (storage) ColorEffect();
+  case MODE_RAINBOW:
+    return new (storage) RainbowEffect();
+  case MODE_SPACE:
+    return new (storage) SpaceEffect();
+  case MODE_STROBO:
+    return new (storage) StroboEffect();
+  case MODE_PROGRESS:
+    return new (storage) ProgressEffect();
+  default:
+    return nullptr;
+  }
+}
@@ -0,0 +1,56 @@
+#include "frame_scheduler.h"
+#include "hal.h"
+
+static unsigned long frame_start = 0;
+static unsigned long frame_deadline = 0;
+static FrameSchedulerStats scheduler_stats = {0, 0, 0, 0};
+
+void frame_scheduler_begin()
+{
+  frame_start = hal_millis();
+  frame_deadline = frame_start;
+}
+
+// Returns the elapsed time in ms since the previous frame started
+unsigned long frame_scheduler_start_frame()
+{
+  unsigned long now = hal_millis();
+  unsigned long dt = now - frame_start;
+  frame_start = now;
+  frame_deadline = now + frame_budget;
+  scheduler_stats.frames++;
+  if (dt > max_frame_dt)
+    dt = max_frame_dt;
+  return dt;
+}
+
+unsigned long frame_scheduler_remaining()
+{
+  long remaining = (long)(frame_deadline - hal_millis());
+  return remaining > 0 ? remaining : 0;
+}
+
+void frame_scheduler_end_frame()
+{
+  unsigned long frame_time = hal_millis() - frame_start;
+  if (frame_time > scheduler_stats.max_frame_time)
+    scheduler_stats.max_frame_time = frame_time;
+
+  if (frame_time > frame_budget)
+    scheduler_stats.missed_deadlines++;
+
+  if (frame_time < frame_period)
+  {
+    hal_delay(frame_period - frame_time);
+  }
+  else
+  {
+    // Whole periods that passed without a frame being rendered
+    scheduler_stats.dropped_frames += frame_time / frame_period - 1;
+  }
+}
+
+const FrameSchedulerStats &frame_scheduler_stats()
+{
+  return scheduler_stats;
+}
@@ -0,0 +1,294 @@
+#include <string.h>
+#include "framebuffer.h"
+#include "color.h"
+
+uint32_t framebuffer[num_pixels];
+
+// Last frame pushed to the strip
+static uint32_t shown_frame[num_pixels];
+static bool framebuffer_forced = true;
+// Gamma corrected and power limited frame as it goes to the strip
+static uint32_t output_frame[num_pixels];
+static FrameStats frame_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+static uint32_t power_budget_ma = POWER_BUDGET_MA;
+static bool input_pending = false;
+static unsigned long input_time = 0;
+
+// Frame a running crossfade starts from
+static uint32_t transition_frame[num_pixels];
+static bool transition_active = false;
+static unsigned long transition_start = 0;
+static unsigned long transition_duration = 0;
+
+// Gamma and brightness folded into one table, rebuilt when the brightness
+// changes so the per-frame pass is three lookups per pixel
+static uint8_t brightness = 255;
+static uint8_t output_table[256];
+static bool output_table_valid = false;
+
+// A running brightness fade. brightness is already its target, the table
+// is built for shown_brightness.
+static bool fade_active = false;
+static uint8_t fade_from = 255;
+static unsigned long fade_start = 0;
+static unsigned long fade_duration = 0;
+static uint8_t shown_brightness = 255;
+
+static void build_output_table()
+{
+  for (uint32_t channel = 0; channel < 256; channel++)
+  {
+    // Scale in perceived space so every knob step looks equally large
+    uint32_t level = channel * shown_brightness * 65535 / (255 * 255);
+    output_table[channel] = (gamma_expand(level) * 255 + 32767) / 65535;
+  }
+  output_table_valid = true;
+}
+
+// Maps one pixel through the output table and adds its channels to sum
+static uint32_t output_color(uint32_t color, uint32_t &sum)
+{
+  uint32_t r = output_table[(color >> 16) & 0xFF];
+  uint32_t g = output_table[(color >> 8) & 0xFF];
+  uint32_t b = output_table[color & 0xFF];
+  sum += r + g + b;
+  return (r << 16) | (g << 8) | b;
+}
+
+static uint32_t estimate_current_ma(uint32_t channel_sum)
+{
+  return num_pixels * pixel_idle_ma + channel_sum * channel_full_ma / 255;
+}
+
+// Share 0..256 of the frame that fits into the power budget, 256 leaves
+// it as it is
+static uint32_t power_scale(uint32_t channel_sum)
+{
+  uint32_t requested_ma = estimate_current_ma(channel_sum);
+  frame_stats.power_requested_ma = requested_ma;
+  if (requested_ma <= power_budget_ma)
+    return 256;
+
+  frame_stats.power_limited++;
+  // The idle draw of the pixels cannot be scaled away
+  const uint32_t idle_ma = num_pixels * pixel_idle_ma;
+  if (power_budget_ma <= idle_ma)
+    return 0;
+  return (power_budget_ma - idle_ma) * 256 / (requested_ma - idle_ma);
+}
+
+static uint32_t scale_color(uint32_t color, uint32_t scale, uint32_t &sum)
+{
+  uint32_t r = (((color >> 16) & 0xFF) * scale) >> 8;
+  uint32_t g = (((color >> 8) & 0xFF) * scale) >> 8;
+  uint32_t b = ((color & 0xFF) * scale) >> 8;
+  sum += r + g + b;
+  return (r << 16) | (g << 8) | b;
+}
+
+static bool frame_is_uniform(const uint32_t *frame)
+{
+  for (int i = 1; i < num_pixels; i++)
+  {
+    if (frame[i] != frame[0])
+      return false;
+  }
+  return true;
+}
+
+// Most effects light the whole strip in one color. Such a frame is mapped
+// and limited once and handed to the strip as a single fill. Returns the
+// channel sum of the frame that goes out.
+static uint32_t output_uniform_frame()
+{
+  uint32_t channel_sum = 0;
+  uint32_t color = output_color(shown_frame[0], channel_sum);
+  uint32_t scale = power_scale(channel_sum * num_pixels);
+  if (scale < 256)
+  {
+    channel_sum = 0;
+    color = scale_color(color, scale, channel_sum);
+  }
+  hal_pixels_fill(color);
+  return channel_sum * num_pixels;
+}
+
+static uint32_t output_mixed_frame()
+{
+  uint32_t channel_sum = 0;
+  for (int i = 0; i < num_pixels; i++)
+  {
+    output_frame[i] = output_color(shown_frame[i], channel_sum);
+  }
+  uint32_t scale = power_scale(channel_sum);
+  if (scale < 256)
+  {
+    channel_sum = 0;
+    for (int i = 0; i < num_pixels; i++)
+    {
+      output_frame[i] = scale_color(output_frame[i], scale, channel_sum);
+    }
+  }
+  hal_pixels_write(output_frame);
+  return channel_sum;
+}
+
+void framebuffer_fill(uint32_t color)
+{
+  for (int i = 0; i < num_pixels; i++)
+  {
+    framebuffer[i] = color;
+  }
+}
+
+// Pushes the next frame even if it did not change
+void framebuffer_invalidate()
+{
+  framebuffer_forced = true;
+}
+
+void framebuffer_set_brightness(uint8_t new_brightness)
+{
+  fade_active = false;
+  brightness = new_brightness;
+  if (new_brightness == shown_brightness)
+    return;
+  shown_brightness = new_brightness;
+  output_table_valid = false;
+  framebuffer_forced = true;
+}
+
+// Ramps the brightness from where it is shown now to new_brightness over
+// duration ms. framebuffer_brightness() reports the target right away.
+void framebuffer_fade_brightness(uint8_t new_brightness, unsigned long duration)
+{
+  if (duration == 0)
+  {
+    framebuffer_set_brightness(new_brightness);
+    return;
+  }
+  brightness = new_brightness;
+  fade_from = shown_brightness;
+  fade_start = hal_millis();
+  fade_duration = duration;
+  fade_active = true;
+}
+
+uint8_t framebuffer_brightness()
+{
+  return brightness;
+}
+
+void framebuffer_set_power_budget(uint32_t budget_ma)
+{
+  if (budget_ma == power_budget_ma)
+    return;
+  power_budget_ma = budget_ma;
+  framebuffer_forced = true;
+}
+
+uint32_t framebuffer_power_budget()
+{
+  return power_budget_ma;
+}
+
+// Fades from the frame currently in the framebuffer to whatever is
+// rendered over the next duration ms. A transition that is still running
+// is taken over from its current mix.
+void framebuffer_start_transition(unsigned long duration)
+{
+  if (duration == 0)
+  {
+    transition_active = false;
+    return;
+  }
+  memcpy(transition_frame, framebuffer, sizeof(transition_frame));
+  transition_active = true;
+  transition_start = hal_millis();
+  transition_duration = duration;
+}
+
+// Mixes the rendered frame with the transition frame, weight 0..256 is
+// the share of the rendered frame
+static void blend_transition()
+{
+  unsigned long elapsed = hal_millis() - transition_start;
+  if (elapsed >= transition_duration)
+  {
+    transition_active = false;
+    return;
+  }
+  int32_t weight = elapsed * 256 / transition_duration;
+  for (int i = 0; i < num_pixels; i++)
+  {
+    uint32_t from = transition_frame[i];
+    uint32_t to = framebuffer[i];
+    framebuffer[i] = blend_channel(from, to, 16, weight) | blend_channel(from, to, 8, weight) |
+                     blend_channel(from, to, 0, weight);
+  }
+}
+
+static void advance_fade()
+{
+  unsigned long elapsed = hal_millis() - fade_start;
+  uint8_t level = brightness;
+  if (elapsed < fade_duration)
+  {
+    int32_t weight = elapsed * 256 / fade_duration;
+    level = fade_from + (((brightness - fade_from) * weight) >> 8);
+  }
+  else
+  {
+    fade_active = false;
+  }
+  if (level == shown_brightness)
+    return;
+  shown_brightness = level;
+  output_table_valid = false;
+  framebuffer_forced = true;
+}
+
+// time is when the input happened, usually the timestamp of its input event
+void framebuffer_mark_input(unsigned long time)
+{
+  input_pending = true;
+  input_time = time;
+}
+
+bool framebuffer_show()
+{
+  if (transition_active)
+    blend_transition();
+  if (fade_active)
+    advance_fade();
+  if (!framebuffer_forced && memcmp(framebuffer, shown_frame, sizeof(shown_frame)) == 0)
+  {
+    frame_stats.skipped++;
+    return false;
+  }
+  memcpy(shown_frame, framebuffer, sizeof(shown_frame));
+  if (!output_table_valid)
+    build_output_table();
+  // The channel sum is only taken for frames that changed, skipped frames
+  // keep the draw of the last pushed one
+  uint32_t channel_sum = frame_is_uniform(shown_frame) ? output_uniform_frame() : output_mixed_frame();
+  frame_stats.power_ma = estimate_current_ma(channel_sum);
+  if (frame_stats.power_ma > frame_stats.power_max_ma)
+    frame_stats.power_max_ma = frame_stats.power_ma;
+  hal_pixels_show();
+  framebuffer_forced = false;
+  frame_stats.pushed++;
+  if (input_pending)
+  {
+    input_pending = false;
+    frame_stats.input_latency_last = hal_millis() - input_time;
+    if (frame_stats.input_latency_last > frame_stats.input_latency_max)
+      frame_stats.input_latency_max = frame_stats.input_latency_last;
+  }
+  return true;
+}
+
+const FrameStats &framebuffer_stats()
+{
+  return frame_stats;
+}
@@ -0,0 +1,401 @@
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <PubSubClient.h>
+#include <DNSServer.h>
+#include <ESP8266WebServer.h>
+#include <WiFiManager.h>
+#include <Adafruit_NeoPixel.h>
+#include <EEPROM.h>
+#include "hal.h"
+#include "input_queue.h"
+
+const int leds_pin = D5;
+const int switch_pin = D1;
+const int rotary_encoder_pin1 = D7;
+const int rotary_encoder_pin2 = D6;
+
+// Upper bound for the blocking TCP connect and the wait for CONNACK and
+// SUBACK. An unreachable broker still freezes the animation for up to 1 s,
+// about 100 frames at the target rate, once per backoff period; shorter
+// timeouts would fail on a slow network.
+const unsigned long mqtt_connect_timeout_ms = 1000;
+const uint16_t mqtt_socket_timeout_s = 1;
+// Fits a raw <root>/frame payload of 86 * 3 bytes with its topic and header
+const uint16_t mqtt_buffer_size = 512;
+
+WiFiClient espClient;
+PubSubClient client(espClient);
+WiFiUDP udp;
+
+Adafruit_NeoPixel pixels = Adafruit_NeoPixel(num_pixels, leds_pin, NEO_GRB + NEO_KHZ800);
+
+// Edges of the switch closer together than this are contact bounce
+const unsigned long switch_debounce_us = 20000;
+
+// Quadrature direction for index (old_state << 2) | new_state, invalid
+// transitions (bounce, missed edge) count as 0
+const int8_t encoder_directions[16] = {0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0};
+
+static uint8_t encoder_state = 0;
+static int encoder_quarters = 0;
+static int encoder_detents = 0;
+
+static bool switch_pressed = false;
+static unsigned long last_switch_edge = 0;
+
+unsigned long hal_millis()
+{
+  return millis();
+}
+
+void hal_delay(unsigned long ms)
+{
+  delay(ms);
+}
+
+void hal_feed_watchdog()
+{
+  ESP.wdtFeed();
+}
+
+uint32_t hal_random()
+{
+  return ESP.random();
+}
+
+uint32_t hal_cycle_count()
+{
+  return ESP.getCycleCount();
+}
+
+uint32_t hal_cycles_per_us()
+{
+  return ESP.getCpuFreqMHz();
+}
+
+uint32_t hal_free_heap()
+{
+  return ESP.getFreeHeap();
+}
+
+uint32_t hal_max_free_block()
+{
+  return ESP.getMaxFreeBlockSize();
+}
+
+uint8_t hal_heap_fragmentation()
+{
+  return ESP.getHeapFragmentation();
+}
+
+const char *hal_reset_reason()
+{
+  // getResetReason() builds a String, keep one copy for the whole run
+  static char reason[32] = "";
+  if (reason[0] == 0)
+    strlcpy(reason, ESP.getResetReason().c_str(), sizeof(reason));
+  return reason;
+}
+
+void hal_gpio_setup()
+{
+  pinMode(LED_BUILTIN, OUTPUT);
+  pinMode(leds_pin, OUTPUT);
+  pinMode(switch_pin, INPUT_PULLUP);
+  pinMode(rotary_encoder_pin1, INPUT);
+  pinMode(rotary_encoder_pin2, INPUT);
+}
+
+void hal_set_status_led(bool on)
+{
+  // The builtin LED of the d1_mini is active low
+  digitalWrite(LED_BUILTIN, on ? LOW : HIGH);
+}
+
+static uint8_t IRAM_ATTR read_encoder_state()
+{
+  return digitalRead(rotary_encoder_pin1) | (digitalRead(rotary_encoder_pin2) << 1);
+}
+
+void IRAM_ATTR encoder_isr()
+{
+  uint8_t state = read_encoder_state();
+  encoder_quarters += encoder_directions[(encoder_state << 2) | state];
+  encoder_state = state;
+  // Report whole detents once the encoder rests in its latch position
+  if (state == 0)
+  {
+    int detents = encoder_quarters >> 2;
+    if (detents != encoder_detents)
+    {
+      input_queue_push(INPUT_ROTATE, detents - encoder_detents, millis());
+      encoder_detents = detents;
+    }
+  }
+}
+
+static void IRAM_ATTR report_switch(bool pressed)
+{
+  switch_pressed = pressed;
+  input_queue_push(pressed ? INPUT_SWITCH_PRESSED : INPUT_SWITCH_RELEASED, 0, millis());
+}
+
+// The first edge after a quiet period is reported at once, the bounce
+// after it only restarts the debounce window
+void IRAM_ATTR switch_isr()
+{
+  unsigned long now = micros();
+  bool pressed = !digitalRead(switch_pin);
+  bool settled = now - last_switch_edge >= switch_debounce_us;
+  last_switch_edge = now;
+  if (settled && pressed != switch_pressed)
+    report_switch(pressed);
+}
+
+// An edge inside the debounce window may have been the real one, so the
+// level the pin settles on is read again once the window is over
+void hal_input_poll()
+{
+  noInterrupts();
+  if (micros() - last_switch_edge >= switch_debounce_us)
+  {
+    bool pressed = !digitalRead(switch_pin);
+    if (pressed != switch_pressed)
+      report_switch(pressed);
+  }
+  interrupts();
+}
+
+void hal_input_begin()
+{
+  encoder_state = read_encoder_state();
+  switch_pressed = !digitalRead(switch_pin);
+  attachInterrupt(digitalPinToInterrupt(rotary_encoder_pin1), encoder_isr, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(rotary_encoder_pin2), encoder_isr, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(switch_pin), switch_isr, CHANGE);
+}
+
+void hal_pixels_begin()
+{
+  pixels.begin();
+}
+
+// The buffer behind getPixels() holds 3 bytes per pixel in the GRB order of
+// the strip. Writing it directly skips setPixelColor(), which unpacks,
+// reorders and checks the bounds of every pixel again.
+void hal_pixels_write(const uint32_t *colors)
+{
+  uint8_t *out = pixels.getPixels();
+  for (int i = 0; i < num_pixels; i++)
+  {
+    uint32_t color = colors[i];
+    out[0] = color >> 8;
+    out[1] = color >> 16;
+    out[2] = color;
+    out += 3;
+  }
+}
+
+void hal_pixels_fill(uint32_t color)
+{
+  // Four pixels are exactly three words, pack them once and store words
+  uint32_t pattern[3];
+  uint8_t *bytes = (uint8_t *)pattern;
+  for (int i = 0; i < 12; i += 3)
+  {
+    bytes[i] = color >> 8;
+    bytes[i + 1] = color >> 16;
+    bytes[i + 2] = color;
+  }
+  // The buffer comes from malloc() and is word aligned
+  uint32_t *out = (uint32_t *)pixels.getPixels();
+  const int length = num_pixels * 3;
+  int word = 0;
+  for (; (word + 3) * 4 <= length; word += 3)
+  {
+    out[word] = pattern[0];
+    out[word + 1] = pattern[1];
+    out[word + 2] = pattern[2];
+  }
+  memcpy(out + word, pattern, length - word * 4);
+}
+
+void hal_pixels_show()
+{
+  pixels.show();
+}
+
+void hal_storage_begin(unsigned int size)
+{
+  EEPROM.begin(size);
+}
+
+bool hal_storage_read(void *data, unsigned int size)
+{
+  if (size > EEPROM.length())
+    return false;
+  memcpy(data, EEPROM.getConstDataPtr(), size);
+  return true;
+}
+
+// EEPROM.commit() erases and rewrites the whole flash sector, so callers
+// should only write when something changed
+bool hal_storage_write(const void *data, unsigned int size)
+{
+  if (size > EEPROM.length())
+    return false;
+  memcpy(EEPROM.getDataPtr(), data, size);
+  return EEPROM.commit();
+}
+
+// Access point of the last connection. It lives in RTC memory, so it
+// survives resets and lets the next start skip the scan.
+struct WifiCache
+{
+  uint32_t magic;
+  int32_t channel;
+  uint8_t bssid[8];
+};
+const uint32_t wifi_cache_magic = 0x6c616d70;
+// Without a connection by then the cached access point is dropped and the
+// station scans for the network
+const unsigned long wifi_cache_timeout_ms = 5000;
+const unsigned long wifi_portal_timeout_s = 180;
+
+static bool wifi_using_cache = false;
+static bool wifi_was_up = false;
+static unsigned long wifi_begin_time = 0;
+
+static void wifi_connect(bool use_cache)
+{
+  WifiCache cache;
+  wifi_using_cache = use_cache && ESP.rtcUserMemoryRead(0, (uint32_t *)&cache, sizeof(cache)) &&
+                     cache.magic == wifi_cache_magic;
+  if (wifi_using_cache)
+    WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), cache.channel, cache.bssid);
+  else
+    WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str());
+  wifi_begin_time = millis();
+}
+
+static void wifi_save_cache()
+{
+  WifiCache cache;
+  cache.magic = wifi_cache_magic;
+  cache.channel = WiFi.channel();
+  memcpy(cache.bssid, WiFi.BSSID(), 6);
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&cache, sizeof(cache));
+}
+
+// Starts connecting with the credentials WiFiManager stored and returns
+// right away. Only a lamp that never had credentials opens the blocking
+// setup portal.
+void hal_wifi_begin()
+{
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+#ifdef WIFI_STATIC_IP
+  // No DHCP round trip, e.g. build_flags = -D WIFI_STATIC_IP=192,168,1,50
+  // -D WIFI_GATEWAY=192,168,1,1 -D WIFI_SUBNET=255,255,255,0
+  WiFi.config(IPAddress(WIFI_STATIC_IP), IPAddress(WIFI_GATEWAY), IPAddress(WIFI_SUBNET), IPAddress(WIFI_GATEWAY));
+#endif
+
+  if (WiFi.SSID().length() == 0)
+  {
+    Serial.println(F("No Wifi credentials stored, open the setup portal."));
+    WiFiManager wifiManager;
+    wifiManager.setConfigPortalTimeout(wifi_portal_timeout_s);
+    if (!wifiManager.startConfigPortal("tube_lamp_setup"))
+      Serial.println(F("Setup portal closed without Wifi, continue offline."));
+    return;
+  }
+  // The portal has to store what was entered, after it the credentials are
+  // already in flash and are not rewritten on every begin
+  WiFi.persistent(false);
+  wifi_connect(true);
+}
+
+void hal_wifi_loop()
+{
+  bool up = WiFi.status() == WL_CONNECTED;
+  if (up && !wifi_was_up)
+    wifi_save_cache();
+  wifi_was_up = up;
+
+  if (!up && wifi_using_cache && millis() - wifi_begin_time > wifi_cache_timeout_ms)
+  {
+    Serial.println(F("Cached access point did not answer, scan for the network."));
+    WifiCache cache = {0, 0, {0}};
+    ESP.rtcUserMemoryWrite(0, (uint32_t *)&cache, sizeof(cache));
+    wifi_connect(false);
+  }
+}
+
+bool hal_wifi_connected()
+{
+  return WiFi.status() == WL_CONNECTED;
+}
+
+int8_t hal_wifi_rssi()
+{
+  return WiFi.RSSI();
+}
+
+void hal_udp_begin(uint16_t port)
+{
+  udp.begin(port);
+}
+
+int hal_udp_parse()
+{
+  return udp.parsePacket();
+}
+
+int hal_udp_read(void *data, int size)
+{
+  return udp.read((uint8_t *)data, size);
+}
+
+void hal_mqtt_setup(const char *server_address, uint16_t server_port, hal_mqtt_callback_t callback)
+{
+  espClient.setTimeout(mqtt_connect_timeout_ms);
+  client.setSocketTimeout(mqtt_socket_timeout_s);
+  client.setBufferSize(mqtt_buffer_size);
+  client.setServer(server_address, server_port);
+  client.setCallback(callback);
+}
+
+bool hal_mqtt_connect(const char *id, const char *username, const char *password)
+{
+  return client.connect(id, username, password);
+}
+
+bool hal_mqtt_connected()
+{
+  return client.connected();
+}
+
+int hal_mqtt_state()
+{
+  return client.state();
+}
+
+bool hal_mqtt_subscribe(const char *topic)
+{
+  return client.subscribe(topic);
+}
+
+bool hal_mqtt_publish(const char *topic, const char *payload)
+{
+  size_t length = strlen(payload);
+  if (length + strlen(topic) + 7 <= mqtt_buffer_size)
+    return client.publish(topic, payload);
+  // Larger payloads, like the stats, are streamed past the client buffer
+  return client.beginPublish(topic, length, false) && client.write((const uint8_t *)payload, length) == length &&
+         client.endPublish();
+}
+
+void hal_mqtt_loop()
+{
+  client.loop();
+}
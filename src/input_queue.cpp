@@ -0,0 +1,36 @@
+#include "input_queue.h"
+
+static InputEvent input_events[input_queue_size];
+static volatile uint8_t input_head = 0;
+static volatile uint8_t input_tail = 0;
+static volatile unsigned long input_overflows = 0;
+
+void INPUT_ISR_ATTR input_queue_push(InputEventType type, int8_t steps, uint32_t time)
+{
+  uint8_t head = input_head;
+  if ((uint8_t)(head - input_tail) == input_queue_size)
+  {
+    input_overflows++;
+    return;
+  }
+  InputEvent &event = input_events[head & (input_queue_size - 1)];
+  event.type = type;
+  event.steps = steps;
+  event.time = time;
+  input_head = head + 1;
+}
+
+bool input_queue_pop(InputEvent &event)
+{
+  uint8_t tail = input_tail;
+  if (tail == input_head)
+    return false;
+  event = input_events[tail & (input_queue_size - 1)];
+  input_tail = tail + 1;
+  return true;
+}
+
+unsigned long input_queue_overflows()
+{
+  return input_overflows;
+}
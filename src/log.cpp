@@ -0,0 +1,127 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include "log.h"
+#include "hal.h"
+
+struct LogEntry
+{
+  bool remote;
+  uint16_t repeats;
+  char text[log_message_length];
+};
+
+static LogEntry log_entries[log_capacity];
+static int log_head = 0;
+static int log_count = 0;
+// Bytes of the oldest entry that already went out to Serial
+static size_t log_written = 0;
+static unsigned long log_unreported_drops = 0;
+static const char *log_mqtt_topic = nullptr;
+static LogStats stats = {0, 0, 0};
+
+void log_begin(const char *mqtt_topic)
+{
+  log_mqtt_topic = mqtt_topic;
+}
+
+void log_message(bool remote, const char *format, ...)
+{
+  char text[log_message_length];
+  va_list args;
+  va_start(args, format);
+  vsnprintf_P(text, sizeof(text), format, args);
+  va_end(args);
+
+  // Repeated messages are folded into the newest entry while it is still untouched
+  if (log_count > 0)
+  {
+    LogEntry &newest = log_entries[(log_head + log_count - 1) % log_capacity];
+    if ((log_count > 1 || log_written == 0) && newest.remote == remote && strcmp(newest.text, text) == 0)
+    {
+      newest.repeats++;
+      stats.aggregated++;
+      return;
+    }
+  }
+
+  if (log_count == log_capacity)
+  {
+    stats.dropped++;
+    log_unreported_drops++;
+    return;
+  }
+
+  LogEntry &entry = log_entries[(log_head + log_count) % log_capacity];
+  entry.remote = remote;
+  entry.repeats = 0;
+  memcpy(entry.text, text, sizeof(text));
+  log_count++;
+  stats.queued++;
+}
+
+void log_trace(const char *message)
+{
+  char text[log_message_length];
+  strncpy_P(text, message, sizeof(text) - 1);
+  text[sizeof(text) - 1] = 0;
+  Serial.println(text);
+}
+
+// Appends the repeat count once, so the entry is written exactly as it will be published
+static void log_finish_entry(LogEntry &entry)
+{
+  if (entry.repeats > 0)
+  {
+    size_t length = strlen(entry.text);
+    snprintf(entry.text + length, sizeof(entry.text) - length, " (x%u)", entry.repeats + 1);
+    entry.repeats = 0;
+  }
+}
+
+void log_drain(unsigned long budget)
+{
+  if (budget > log_budget)
+    budget = log_budget;
+  unsigned long start = hal_millis();
+
+  if (log_unreported_drops > 0 && log_count < log_capacity)
+  {
+    unsigned long drops = log_unreported_drops;
+    log_unreported_drops = 0;
+    log_message(false, PSTR("[LOG] %lu messages dropped"), drops);
+  }
+
+  while (log_count > 0 && hal_millis() - start <= budget)
+  {
+    LogEntry &entry = log_entries[log_head];
+    if (log_written == 0)
+      log_finish_entry(entry);
+
+    // Only hand Serial what fits into its transmit FIFO, so the drain never blocks
+    size_t length = strlen(entry.text);
+    while (log_written < length + 2)
+    {
+      size_t space = Serial.availableForWrite();
+      if (space == 0)
+        return;
+      const char *pending = log_written < length ? entry.text + log_written : "\r\n" + (log_written - length);
+      size_t chunk = strlen(pending);
+      if (chunk > space)
+        chunk = space;
+      Serial.write((const uint8_t *)pending, chunk);
+      log_written += chunk;
+    }
+
+    if (entry.remote && log_mqtt_topic && hal_mqtt_connected())
+      hal_mqtt_publish(log_mqtt_topic, entry.text);
+
+    log_written = 0;
+    log_head = (log_head + 1) % log_capacity;
+    log_count--;
+  }
+}
+
+const LogStats &log_stats()
+{
+  return stats;
+}
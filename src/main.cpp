@@ -1,206 +1,137 @@
-#include <ESP8266WiFi.h>
-#include <PubSubClient.h>
-#include <DNSServer.h>
-#include <ESP8266WebServer.h>
-#include <WiFiManager.h>
-#include <WString.h>
-#include <Adafruit_NeoPixel.h>
-#include <RotaryEncoder.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "hal.h"
+#include "framebuffer.h"
+#include "frame_scheduler.h"
+#include "command_parser.h"
+#include "log.h"
+#include "color.h"
+#include "input_queue.h"
+#include "effects.h"
+#include "mqtt_connection.h"
+#include "palette.h"
+#include "persistence.h"
+#include "realtime.h"
+#include "segments.h"
+#include "telemetry.h"
 #include "secrets.h"
 
-const int leds_pin = D5;
-const int switch_pin = D1;
-const int rotary_encoder_pin1 = D7;
-const int rotary_encoder_pin2 = D6;
-
-char mqtt_topic_mode[100];
-char mqtt_topic_color[100];
-char mqtt_topic_hsv[100];
-char mqtt_topic_flash[100];
-char mqtt_topic_progress[100];
-char mqtt_topic_control[100];
-char mqtt_topic_log[100];
-
-static unsigned long last_connection_attempt = 0;
-bool connected = false;
-const int reconnect_delay = 1000;
-
-const int num_pixels = 86;
-
-int rainbow_wheel_speed = 20;
-static unsigned long last_rainbow_wheel_change = 0;
-int rainbow_wheel_pos = 0;
-uint32_t rainbowColors[256];
-
-int space_wheel_speed = 1;
-static unsigned long last_space_wheel_change = 0;
-int space_wheel_pos = 0;
-
-int strobo_off_period = 100;
-int strobo_on_period = 8;
-static unsigned long last_strobo_change = 0;
-bool strobo_state = false;
-
-const int error_wheel_speed = 5;
-static unsigned long last_error_wheel_change = 0;
-int error_wheel_pos = 0;
-
-int flash_speed = 200;
-static unsigned long last_flash_change = 0;
-const int start_flash_count = 5;
-int flash_count = start_flash_count;
-bool flash_state = false;
-
-int current_progress = 0;
-int progress_wheel_speed = 20;
-static unsigned long last_progress_wheel_change = 0;
-int progress_wheel_pos = 0;
-
-const int default_color = 0;
-int current_color = default_color;
-int flash_color = default_color;
-
-const int MODE_ERROR = 0;
-const int MODE_NORMAL = 1;
-const int MODE_RAINBOW = 2;
-const int MODE_SPACE = 3;
-const int MODE_STROBO = 4;
-const int MODE_PROGRESS = 5;
-const int MODE_FLASH = 6;
+// Allocated once in setup() with their exact length
+char *mqtt_topic_mode = nullptr;
+char *mqtt_topic_log = nullptr;
+char *mqtt_topic_stats = nullptr;
+char *mqtt_topic_json = nullptr;
+size_t mqtt_topic_root_length = 0;
+
+unsigned long frame_dt = 0;
+bool wifi_was_connected = false;
+
+// Milliseconds from power-on to each milestone, -1 until it is reached
+struct BootStats
+{
+  long first_frame;
+  long wifi;
+  long mqtt;
+  long first_command;
+};
+BootStats boot_stats = {-1, -1, -1, -1};
+
 const int default_mode = MODE_NORMAL;
 const int lowest_mode = MODE_NORMAL;
 const int highest_mode = MODE_PROGRESS;
 int current_mode = default_mode;
 int mode_before_error = current_mode;
-int mode_before_flash = current_mode;
+// Mode that flash and realtime streaming return to once they end
+int interrupted_mode = current_mode;
+// Set when local input leaves the error mode while MQTT is still down
+bool error_dismissed = false;
 
 const char *RAINBOW_SPEED_CMD = "rs";
 const char *SPACE_SPEED_CMD = "sps";
 const char *STROBO_SPEED_CMD = "sts";
-
+const char *POWER_BUDGET_CMD = "pb";
+const char *TRANSITION_CMD = "tr";
+const char *STATS_INTERVAL_CMD = "si";
+const char *PALETTE_CMD = "pal";
+
+// Crossfade between colors and modes, 0 cuts hard
+unsigned long transition_duration = 400;
+// Longer transitions are rejected, this also keeps the float seconds of
+// the JSON schema in range of the conversion to ms
+const unsigned long max_transition = 600000;
+
+// Also the length of the telemetry interval, set with the si command
+unsigned long stats_interval = 10000;
+const unsigned long min_stats_interval = 1000;
+unsigned long last_stats_publish = 0;
+
+// The knob sets the global brightness, starting at full
 const int rotary_max = 12;
-int rot_last_pos = 0;
-
-int last_switch_triggering = -1;
-bool switch_was_pressed = false;
-
-const bool DEBUG_WDT = false;
-
-WiFiClient espClient;
-PubSubClient client(espClient);
+int rot_last_pos = rotary_max;
+// Brightness restored when the lamp is switched on over the JSON topic
+uint8_t on_brightness = 255;
 
-Adafruit_NeoPixel pixels = Adafruit_NeoPixel(num_pixels, leds_pin, NEO_GRB + NEO_KHZ800);
+// Values we published ourselves and expect to come back from the broker
+const int echo_filter_size = 8;
+struct EchoFilter
+{
+  int values[echo_filter_size];
+  int count;
+};
+EchoFilter mode_echoes = {{0}, 0};
 
-RotaryEncoder rot_encoder(rotary_encoder_pin1, rotary_encoder_pin2);
+bool switch_was_pressed = false;
 
-void setup_wifi();
-void blink(int blinkCount, bool lamp_blink);
-void init_mode_change(int new_mode);
-void init_color_change(int new_color);
-void init_gray_shade(float whiteness);
+void change_mode(int new_mode);
 void mqtt_callback(char *topicChar, byte *payload, unsigned int length);
 void setError(bool error_occured);
-void reconnect();
-void showError(byte WheelPos);
-void showRainbow(byte WheelPos);
-void showSpace(byte WheelPos);
-void showProgress(int progress, int wheel_pos);
-void showStrobo(bool stobo_state);
-void showRGB(int R, int G, int B);
-void showColor(int color);
-void handle_rot_encoder();
-void calcRainbowColors();
+void handle_input_events();
+void restore_state();
+void mqtt_connect_command_topics();
 int hsv_to_rgb(float h, float s, float v);
-int get_color_from_hsv_command(String command);
-
-// void ICACHE_RAM_ATTR switch_triggered()
-// {
-//   long now = millis();
-//   if (now - last_switch_triggering > 100)
-//   {
-//     last_switch_triggering = now;
-//     switch_was_pressed = true;
-//   }
-// }
+int get_color_from_hsv_command(const char *command, unsigned int length);
 
-void setup()
+// Root plus suffix (in flash). Only called during setup, so the blocks
+// sit at the bottom of the heap and never fragment it.
+char *make_topic(const char *suffix)
 {
-  Serial.begin(9600);
+  char *topic = new char[mqtt_topic_root_length + strlen_P(suffix) + 1];
+  strcpy(topic, mqtt_topic_root);
+  strcpy_P(topic + mqtt_topic_root_length, suffix);
+  return topic;
+}
 
-  pinMode(LED_BUILTIN, OUTPUT);
-  pinMode(leds_pin, OUTPUT);
-  pinMode(switch_pin, INPUT_PULLUP);
-  pinMode(rotary_encoder_pin1, INPUT);
-  pinMode(rotary_encoder_pin2, INPUT);
+void setup()
+{
+  Serial.begin(115200);
 
-  digitalWrite(LED_BUILTIN, LOW);
-  pixels.begin();
-  setError(false);
-  blink(5, true);
+  hal_gpio_setup();
 
-  calcRainbowColors();
+  hal_set_status_led(true);
+  hal_pixels_begin();
 
-  setup_wifi();
+  restore_state();
 
-  client.setServer(mqtt_server_address, mqtt_server_port);
-  client.setCallback(mqtt_callback);
+  hal_wifi_begin();
 
-  rot_encoder.setPosition(0);
+  hal_mqtt_setup(mqtt_server_address, mqtt_server_port, mqtt_callback);
 
-  // attachInterrupt(digitalPinToInterrupt(switch_pin), switch_triggered, FALLING);
+  hal_input_begin();
+  realtime_begin();
 
-  strcpy(mqtt_topic_mode, mqtt_topic_root);
-  strcat(mqtt_topic_mode, "/mode");
-  strcpy(mqtt_topic_color, mqtt_topic_root);
-  strcat(mqtt_topic_color, "/color");
-  strcpy(mqtt_topic_hsv, mqtt_topic_root);
-  strcat(mqtt_topic_hsv, "/hsv");
-  strcpy(mqtt_topic_control, mqtt_topic_root);
-  strcat(mqtt_topic_control, "/control");
-  strcpy(mqtt_topic_log, mqtt_topic_root);
-  strcat(mqtt_topic_log, "/log");
-  strcpy(mqtt_topic_flash, mqtt_topic_root);
-  strcat(mqtt_topic_flash, "/flash");
-  strcpy(mqtt_topic_progress, mqtt_topic_root);
-  strcat(mqtt_topic_progress, "/progress");
+  mqtt_topic_root_length = strlen(mqtt_topic_root);
+  mqtt_topic_mode = make_topic(PSTR("/mode"));
+  mqtt_topic_log = make_topic(PSTR("/log"));
+  mqtt_topic_stats = make_topic(PSTR("/stats"));
+  mqtt_topic_json = make_topic(PSTR("/json"));
+  log_begin(mqtt_topic_log);
+  // The restored mode shows while the lamp connects, the error animation
+  // only starts once a connection attempt fails
+  mqtt_connect_command_topics();
 
-  blink(2, true);
+  frame_scheduler_begin();
 }
 
-void setup_wifi()
-{
-  WiFi.setAutoReconnect(true);
-  WiFiManager wifiManager;
-  Serial.println("Try to connect to Wifi");
-  if (!wifiManager.autoConnect("tube_lamp_setup"))
-  {
-    Serial.println("Failed to connect to Wifi! Restart in 3 seconds.");
-    delay(3000);
-    ESP.reset();
-    delay(5000);
-  }
-  Serial.println("Successfully connected to Wifi.");
-}
-
-void blink(int blinkCount, bool lamp_blink)
-{
-  if (blinkCount > 0)
-  {
-    digitalWrite(LED_BUILTIN, LOW);
-    if (lamp_blink)
-    {
-      showRGB(10, 10, 10);
-    }
-    delay(150);
-    digitalWrite(LED_BUILTIN, HIGH);
-    if (lamp_blink)
-    {
-      showRGB(0, 0, 0);
-    }
-    delay(150);
-    blink(blinkCount - 1, lamp_blink);
-  }
-}
 
 int hsv_to_rgb(float h, float s, float v)
 {
@@ -211,804 +142,893 @@ int hsv_to_rgb(float h, float s, float v)
   s = constrain(s, 0, 1);
   v = constrain(v, 0, 1);
 
-  float c = v * s;
-  float x = c * (1 - fabs(fmod(h / 60.0, 2) - 1));
-  float m = v - c;
-
-  float r_f, g_f, b_f;
+  // Hues just below 360 round up to 65536, which wraps to red in integer
+  // space instead of overflowing the uint16_t
+  uint16_t hue = (uint32_t)(h * (65536 / 360.0f) + 0.5f) & 0xFFFF;
+  return hsv_to_rgb_fixed(hue, s * hsv_one + 0.5f, v * hsv_one + 0.5f);
+}
 
-  if (h < 60)
-  {
-    r_f = c;
-    g_f = x;
-    b_f = 0;
-  }
-  else if (h < 120)
-  {
-    r_f = x;
-    g_f = c;
-    b_f = 0;
-  }
-  else if (h < 180)
-  {
-    r_f = 0;
-    g_f = c;
-    b_f = x;
-  }
-  else if (h < 240)
-  {
-    r_f = 0;
-    g_f = x;
-    b_f = c;
-  }
-  else if (h < 300)
-  {
-    r_f = x;
-    g_f = 0;
-    b_f = c;
-  }
-  else
+int get_color_from_hsv_command(const char *command, unsigned int length)
+{
+  const char *cursor = command;
+  const char *end = command + length;
+  float h = parse_float(cursor, end);
+  if (cursor != command && parse_skip(cursor, end, ','))
   {
-    r_f = c;
-    g_f = 0;
-    b_f = x;
-  }
+    const char *s_start = cursor;
+    float s = parse_float(cursor, end);
+    if (cursor != s_start && parse_skip(cursor, end, ','))
+    {
+      float v = parse_float(cursor, end);
 
-  uint8_t r = (r_f + m) * 255;
-  uint8_t g = (g_f + m) * 255;
-  uint8_t b = (b_f + m) * 255;
+      LOG_REMOTE("[HSV] H=%.2f S=%.2f V=%.2f", h, s, v);
 
-  return r * 256 * 256 + g * 256 + b;
+      return hsv_to_rgb(h, s, v);
+    }
+  }
+
+  LOG_REMOTE("[HSV] Invalid hsv command");
+  return 0;
 }
 
-int get_color_from_hsv_command(String hsv_command)
+void echo_expect(EchoFilter &filter, int value)
 {
-  int first_comma_idx = hsv_command.indexOf(",");
-  if (first_comma_idx > 0)
+  if (filter.count == echo_filter_size)
   {
-    String h_command = hsv_command.substring(0, first_comma_idx);
-    float h = h_command.toFloat();
-    String sv_command = hsv_command.substring(first_comma_idx + 1);
-    int second_comma_idx = sv_command.indexOf(",");
-    if (second_comma_idx > 0)
-    {
-      String s_command = sv_command.substring(0, second_comma_idx);
-      String v_command = sv_command.substring(second_comma_idx + 1);
-      float s = s_command.toFloat();
-      float v = v_command.toFloat();
+    memmove(filter.values, filter.values + 1, sizeof(int) * (echo_filter_size - 1));
+    filter.count--;
+  }
+  filter.values[filter.count++] = value;
+}
 
-      String log_message("[HSV] H=");
-      log_message.concat(h);
-      log_message.concat(" S=");
-      log_message.concat(s);
-      log_message.concat(" V=");
-      log_message.concat(v);
-      Serial.println(log_message);
-      client.publish(mqtt_topic_log, log_message.c_str());
+// Set when the handler of the current message found it to be an echo
+bool message_was_echo = false;
 
-      return hsv_to_rgb(h, s, v);
+// Returns true if value is the echo of one of our own publishes. Older
+// pending echoes are discarded with it, the broker delivers them in order.
+bool echo_consume(EchoFilter &filter, int value)
+{
+  for (int i = 0; i < filter.count; i++)
+  {
+    if (filter.values[i] == value)
+    {
+      filter.count -= i + 1;
+      memmove(filter.values, filter.values + i + 1, sizeof(int) * filter.count);
+      message_was_echo = true;
+      return true;
     }
   }
+  return false;
+}
 
-  Serial.println("Invalid hsv command.");
-  String log_message("[HSV] Invalid hsv command");
-  client.publish(mqtt_topic_log, log_message.c_str());
-  return 0;
+// All sections at their widest counters take about 1.7 KB. The buffer is
+// static, on the stack it would take almost half of the 4 KB.
+char stats_message[1792];
+
+void publish_stats()
+{
+  const FrameStats &stats = framebuffer_stats();
+  const MqttConnectionStats &mqtt = mqtt_connection_stats();
+  const PersistenceStats &storage = persistence_stats();
+  char *message = stats_message;
+  const size_t size = sizeof(stats_message);
+  size_t length = snprintf_P(message, size,
+           PSTR("{\"power_ma\":%u,\"power_requested_ma\":%u,\"power_max_ma\":%u,\"power_budget_ma\":%u,"
+           "\"power_limited_frames\":%lu,\"mqtt_connects\":%lu,\"mqtt_failures\":%lu,\"mqtt_connect_ms\":%lu,"
+           "\"mqtt_connect_max_ms\":%lu,\"mqtt_subscribe_ms\":%lu,\"mqtt_disconnected_ms\":%lu,"
+           "\"boot_first_frame_ms\":%ld,\"boot_wifi_ms\":%ld,\"boot_mqtt_ms\":%ld,\"boot_first_command_ms\":%ld,"
+           "\"persist_writes\":%lu,\"persist_bytes\":%lu,\"persist_coalesced\":%lu,"),
+           (unsigned int)stats.power_ma, (unsigned int)stats.power_requested_ma, (unsigned int)stats.power_max_ma,
+           (unsigned int)framebuffer_power_budget(), stats.power_limited, mqtt.connects, mqtt.failures,
+           mqtt.connect_time_last, mqtt.connect_time_max, mqtt.subscribe_time_last, mqtt.disconnected_time,
+           boot_stats.first_frame, boot_stats.wifi, boot_stats.mqtt, boot_stats.first_command, storage.writes,
+           storage.bytes_written, storage.coalesced);
+  if (length < size)
+    length += telemetry_format(message + length, size - length);
+  // telemetry_format() stops one short of the end when it runs out of room
+  if (length + 2 >= size)
+  {
+    LOG_WARN("Stats do not fit into %u bytes, skip them", (unsigned int)size);
+    return;
+  }
+  message[length] = '}';
+  message[length + 1] = 0;
+  hal_mqtt_publish(mqtt_topic_stats, message);
 }
 
-void init_mode_change(int new_mode)
+// Full lamp state in the Home Assistant JSON light schema
+void publish_json_state()
 {
-  String mode_message(new_mode);
-  client.publish(mqtt_topic_mode, mode_message.c_str());
+  if (!hal_mqtt_connected())
+    return;
+
+  StaticJsonDocument<384> state;
+  uint8_t brightness = framebuffer_brightness();
+  state["state"] = brightness > 0 ? "ON" : "OFF";
+  state["brightness"] = brightness > 0 ? brightness : on_brightness;
+  state["color_mode"] = "rgb";
+  int color = effects[MODE_NORMAL]->get_parameter(PARAM_COLOR);
+  JsonObject rgb = state.createNestedObject("color");
+  rgb["r"] = (color >> 16) & 0xFF;
+  rgb["g"] = (color >> 8) & 0xFF;
+  rgb["b"] = color & 0xFF;
+  state["effect"] = effects[current_mode]->name;
+  state["transition"] = transition_duration / 1000.0f;
+  state["rainbow_speed"] = effects[MODE_RAINBOW]->get_parameter(PARAM_SPEED);
+  state["space_speed"] = effects[MODE_SPACE]->get_parameter(PARAM_SPEED);
+  state["palette"] = palette_selected();
+  state["strobo_on"] = effects[MODE_STROBO]->get_parameter(PARAM_ON_PERIOD);
+  state["strobo_off"] = effects[MODE_STROBO]->get_parameter(PARAM_OFF_PERIOD);
+
+  char message[384];
+  serializeJson(state, message, sizeof(message));
+  hal_mqtt_publish(mqtt_topic_json, message);
 }
 
-void init_color_change(int new_color)
+void publish_state(const char *topic, EchoFilter &echoes, int value)
 {
-  String color_message(new_color);
-  client.publish(mqtt_topic_color, color_message.c_str());
+  char message[12];
+  snprintf(message, sizeof(message), "%d", value);
+  if (hal_mqtt_connected() && hal_mqtt_publish(topic, message))
+    echo_expect(echoes, value);
 }
 
-void init_gray_shade(float whiteness)
+void apply_mode(int new_mode, unsigned long transition = transition_duration)
 {
-  int shade = 255 * whiteness;
-  int color = shade + shade * 256 + shade * 256 * 256;
-  init_color_change(color);
+  // Flashes are signals and have to start crisp, streamed frames are
+  // shown as they are
+  if (new_mode == MODE_FLASH || new_mode == MODE_REALTIME)
+    framebuffer_start_transition(0);
+  else
+    framebuffer_start_transition(transition);
+  current_mode = new_mode;
+  effects[current_mode]->init();
+  LOG_REMOTE("[MODE] Mode has been set to %s", effects[new_mode]->name);
 }
 
-void init_warm_shade(float brightness)
+// Applies the mode right away and reports it to the broker afterwards
+void change_mode(int new_mode)
 {
-  int color = hsv_to_rgb(25.0, 0.97, brightness);
-  init_color_change(color);
+  if (current_mode == MODE_ERROR)
+    error_dismissed = true;
+  apply_mode(new_mode);
+  publish_state(mqtt_topic_mode, mode_echoes, new_mode);
+  publish_json_state();
 }
 
-void mqtt_callback(char *topicChar, byte *payload, unsigned int length)
+void handle_color_message(const char *payload, const char *end)
 {
-  Serial.print("Message arrived in topic [");
-  Serial.print(topicChar);
-  Serial.print("]: ");
+  int new_color = parse_int(payload, end);
 
-  char payloadChar[length + 1];
+  LOG_INFO("Change the color of the lamp and set mode to NORMAL");
 
-  for (int i = 0; i < length; i++)
-  {
-    Serial.print((char)payload[i]);
-    payloadChar[i] = (char)payload[i];
-  }
-  Serial.println();
-  payloadChar[length] = 0;
+  effects[MODE_NORMAL]->set_parameter(PARAM_COLOR, new_color);
 
-  String topic(topicChar);
-  String command(payloadChar);
+  LOG_REMOTE("[COLOR] New color has been set");
 
-  if (topic.equals(mqtt_topic_color))
-  {
-    Serial.println("Change the color of the lamp and set mode to NORMAL");
+  change_mode(MODE_NORMAL);
+}
 
-    current_color = command.toInt();
+void handle_hsv_message(const char *payload, const char *end)
+{
+  LOG_INFO("Change the hsv color of the lamp and set mode to NORMAL");
 
-    String log_message("[COLOR] New color has been set");
-    client.publish(mqtt_topic_log, log_message.c_str());
+  effects[MODE_NORMAL]->set_parameter(PARAM_COLOR, get_color_from_hsv_command(payload, end - payload));
 
-    // current_mode = MODE_NORMAL;
-    // String mode_message("1");
-    // client.publish(mqtt_topic_mode,mode_message.c_str());
-    init_mode_change(MODE_NORMAL);
-  }
-  if (topic.equals(mqtt_topic_hsv))
-  {
-    Serial.println("Change the hsv color of the lamp and set mode to NORMAL");
+  LOG_REMOTE("[HSV] New hsv color has been set");
 
-    current_color = get_color_from_hsv_command(command);
+  change_mode(MODE_NORMAL);
+}
 
-    String log_message("[HSV] New hsv color has been set");
-    client.publish(mqtt_topic_log, log_message.c_str());
+void handle_flash_message(const char *payload, const char *end)
+{
+  LOG_INFO("Change the flash color and count of the lamp and set mode to FLASH");
 
-    init_mode_change(MODE_NORMAL);
-  }
-  if (topic.equals(mqtt_topic_flash))
-  {
-    Serial.println("Change the flash color and count of the lamp and set mode to FLASH");
+  effects[MODE_FLASH]->set_parameter(PARAM_COLOR, parse_int(payload, end));
+  effects[MODE_FLASH]->set_parameter(PARAM_COUNT, parse_int(payload, end));
 
-    int splitIndex = command.indexOf(" ");
-    flash_color = command.substring(0, splitIndex).toInt();
-    flash_count = command.substring(splitIndex + 1).toInt();
+  LOG_REMOTE("[FLASH] New flash color and count has been set");
 
-    String log_message("[FLASH] New flash color and count has been set");
-    client.publish(mqtt_topic_log, log_message.c_str());
+  if (current_mode != MODE_FLASH && current_mode != MODE_REALTIME)
+    interrupted_mode = current_mode;
+  change_mode(MODE_FLASH);
+}
 
-    if (current_mode != MODE_FLASH)
-      mode_before_flash = current_mode;
-    init_mode_change(MODE_FLASH);
-  }
-  if (topic.equals(mqtt_topic_progress))
-  {
-    Serial.println("Update the current progress value");
+void handle_progress_message(const char *payload, const char *end)
+{
+  LOG_INFO("Update the current progress value");
 
-    current_progress = command.toInt();
+  effects[MODE_PROGRESS]->set_parameter(PARAM_PROGRESS, parse_int(payload, end));
+  segments_set_parameter(PARAM_PROGRESS, effects[MODE_PROGRESS]->get_parameter(PARAM_PROGRESS));
 
-    String log_message("[PROGRESS] New value: ");
-    log_message.concat(current_progress);
-    client.publish(mqtt_topic_log, log_message.c_str());
-  }
-  if (topic.equals(mqtt_topic_control))
-  {
-    Serial.println("New command in control topic arrived");
+  LOG_REMOTE("[PROGRESS] New value: %d", effects[MODE_PROGRESS]->get_parameter(PARAM_PROGRESS));
+}
+
+// Moves the cursor past a control command and the separator that follows it
+bool parse_control_command(const char *&cursor, const char *end, const char *command)
+{
+  if (!parse_starts_with(cursor, end, command))
+    return false;
+  cursor += strlen(command);
+  if (cursor < end)
+    cursor++;
+  return true;
+}
+
+void handle_control_message(const char *payload, const char *end)
+{
+  LOG_INFO("New command in control topic arrived");
 
-    if (command.startsWith(RAINBOW_SPEED_CMD))
+  if (parse_control_command(payload, end, RAINBOW_SPEED_CMD))
+  {
+    int value = parse_int(payload, end);
+    if (effects[MODE_RAINBOW]->set_parameter(PARAM_SPEED, value))
     {
-      command.replace(RAINBOW_SPEED_CMD, "");
-      command.remove(0, 1);
-      int value = command.toInt();
-      if (value > 0)
-      {
-        rainbow_wheel_speed = value;
-        Serial.print("Set rainbow speed to: ");
-        Serial.println(rainbow_wheel_speed);
-        String log_message("[CTRL] Set rainbow wheelspeed to ");
-        log_message.concat(rainbow_wheel_speed);
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
-      else
-      {
-        Serial.print("Illegal rainbow speed");
-        String log_message("[CTRL] Illegal rainbow wheelspeed");
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
+      LOG_REMOTE("[CTRL] Set rainbow wheelspeed to %d", value);
     }
-    else if (command.startsWith(SPACE_SPEED_CMD))
+    else
     {
-      command.replace(SPACE_SPEED_CMD, "");
-      command.remove(0, 1);
-      int value = command.toInt();
-      if (value > 0)
-      {
-        space_wheel_speed = value;
-        Serial.print("Set space speed to: ");
-        Serial.println(space_wheel_speed);
-        String log_message("[CTRL] Set space wheelspeed to ");
-        log_message.concat(space_wheel_speed);
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
-      else
-      {
-        Serial.print("Illegal space speed");
-        String log_message("[CTRL] Illegal space wheelspeed");
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
+      LOG_REMOTE("[CTRL] Illegal rainbow wheelspeed");
     }
-    else if (command.startsWith(STROBO_SPEED_CMD))
+  }
+  else if (parse_control_command(payload, end, SPACE_SPEED_CMD))
+  {
+    int value = parse_int(payload, end);
+    if (effects[MODE_SPACE]->set_parameter(PARAM_SPEED, value))
     {
-      command.replace(STROBO_SPEED_CMD, "");
-      command.remove(0, 1);
-      int splitIndex = command.indexOf(" ");
-      int on_period = command.substring(0, splitIndex).toInt();
-      int off_period = command.substring(splitIndex + 1).toInt();
-      if (on_period > 0 && off_period > 0)
-      {
-        strobo_on_period = on_period;
-        strobo_off_period = off_period;
-        Serial.print("Set strobo on period to: ");
-        Serial.println(strobo_on_period);
-        Serial.print("Set strobo off period to: ");
-        Serial.println(strobo_off_period);
-        String log_message("[CTRL] Set strobo periods to ");
-        log_message.concat(strobo_on_period);
-        log_message.concat(" (on) and ");
-        log_message.concat(strobo_off_period);
-        log_message.concat(" (off)");
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
-      else
-      {
-        Serial.print("Illegal strobo speed");
-        String log_message("[CTRL] Illegal strobo speed");
-        client.publish(mqtt_topic_log, log_message.c_str());
-      }
+      LOG_REMOTE("[CTRL] Set space wheelspeed to %d", value);
     }
     else
     {
-      Serial.print("Unknown command: ");
-      Serial.println(command);
-      String log_message("[CMD] Unknown command");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Illegal space wheelspeed");
     }
   }
-  else if (topic.equals(mqtt_topic_mode))
+  else if (parse_control_command(payload, end, STROBO_SPEED_CMD))
   {
-    Serial.println("Mode change has been initiated");
-
-    int new_mode = command.toInt();
-    switch (new_mode)
+    int on_period = parse_int(payload, end);
+    int off_period = parse_int(payload, end);
+    if (on_period > 0 && off_period > 0)
     {
-    case MODE_ERROR:
+      effects[MODE_STROBO]->set_parameter(PARAM_ON_PERIOD, on_period);
+      effects[MODE_STROBO]->set_parameter(PARAM_OFF_PERIOD, off_period);
+      LOG_REMOTE("[CTRL] Set strobo periods to %d (on) and %d (off)", on_period, off_period);
+    }
+    else
     {
-      Serial.println("Change the mode of the lamp to ERROR");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to ERROR");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Illegal strobo speed");
     }
-    break;
-    case MODE_NORMAL:
+  }
+  else if (parse_control_command(payload, end, POWER_BUDGET_CMD))
+  {
+    int budget = parse_int(payload, end);
+    if (budget > num_pixels * (int)pixel_idle_ma)
     {
-      Serial.println("Change the mode of the lamp to NORMAL");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to NORMAL");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      framebuffer_set_power_budget(budget);
+      LOG_REMOTE("[CTRL] Set power budget to %d mA", budget);
     }
-    break;
-    case MODE_RAINBOW:
+    else
     {
-      Serial.println("Change the mode of the lamp to RAINBOW");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to RAINBOW");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Illegal power budget");
     }
-    break;
-    case MODE_SPACE:
+  }
+  else if (parse_control_command(payload, end, TRANSITION_CMD))
+  {
+    int duration = parse_int(payload, end);
+    if (duration >= 0 && (unsigned long)duration <= max_transition)
     {
-      Serial.println("Change the mode of the lamp to SPACE");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to SPACE");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      transition_duration = duration;
+      LOG_REMOTE("[CTRL] Set transition duration to %d ms", duration);
     }
-    break;
-    case MODE_STROBO:
+    else
     {
-      Serial.println("Change the mode of the lamp to STROBO");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to STROBO");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Illegal transition duration");
     }
-    break;
-    case MODE_PROGRESS:
+  }
+  else if (parse_control_command(payload, end, PALETTE_CMD))
+  {
+    int slot = parse_int(payload, end);
+    if (palette_select(slot))
     {
-      Serial.println("Change the mode of the lamp to PROGRESS");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to PROGRESS");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Set palette to %d", slot);
     }
-    break;
-    case MODE_FLASH:
+    else
     {
-      Serial.println("Change the mode of the lamp to FLASH");
-      current_mode = new_mode;
-      String log_message("[MODE] Mode has been set to FLASH");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      LOG_REMOTE("[CTRL] Illegal palette");
     }
-    break;
-    default:
+  }
+  else if (parse_control_command(payload, end, STATS_INTERVAL_CMD))
+  {
+    int interval = parse_int(payload, end);
+    if (interval >= (int)min_stats_interval)
     {
-      Serial.println("Mode is not available. Do not change the mode");
-      String log_message("[MODE] Mode is not available. Do not change the mode");
-      client.publish(mqtt_topic_log, log_message.c_str());
+      stats_interval = interval;
+      LOG_REMOTE("[CTRL] Set stats interval to %d ms", interval);
     }
-    break;
+    else
+    {
+      LOG_REMOTE("[CTRL] Illegal stats interval");
     }
   }
+  else
+  {
+    LOG_INFO("Unknown command: %.*s", (int)(end - payload), payload);
+    LOG_REMOTE("[CMD] Unknown command");
+  }
+}
 
-  // blink(1);
+// Modes a client can select by number or name. Errors, flashes and
+// realtime streams are only entered through their own paths.
+bool mode_selectable(int mode)
+{
+  if (mode == MODE_SEGMENTS)
+    return segments_count() > 0;
+  return mode >= lowest_mode && mode <= highest_mode;
 }
 
-void setError(bool error_occured)
+void handle_mode_message(const char *payload, const char *end)
 {
-  if (error_occured)
+  int new_mode = parse_int(payload, end);
+  if (echo_consume(mode_echoes, new_mode))
+    return;
+
+  LOG_INFO("Mode change has been initiated");
+
+  if (mode_selectable(new_mode))
   {
-    Serial.println("Set error mode on");
-    if (current_mode != MODE_ERROR)
-    {
-      mode_before_error = current_mode;
-      current_mode = MODE_ERROR;
-    }
+    apply_mode(new_mode);
+    publish_json_state();
   }
   else
   {
-    Serial.println("Set error mode off");
-    if (current_mode == MODE_ERROR)
-    {
-      current_mode = mode_before_error;
-    }
+    LOG_REMOTE("[MODE] Mode is not available. Do not change the mode");
   }
 }
 
-void reconnect()
+void set_brightness(uint8_t brightness, unsigned long fade = 0)
+{
+  framebuffer_fade_brightness(brightness, fade);
+  // Turning the knob continues from the new brightness
+  rot_last_pos = (brightness * rotary_max + 127) / 255;
+}
+
+// A positive integer field, 0 if it is missing and -1 if it is invalid
+int json_positive(const JsonDocument &command, const char *key)
+{
+  if (!command.containsKey(key))
+    return 0;
+  int value = command[key] | -1;
+  return value > 0 ? value : -1;
+}
+
+// Sets the whole lamp state from one message in the Home Assistant JSON
+// light schema. Every field is checked before anything is applied, so a
+// command either takes effect completely or not at all.
+void handle_json_message(const char *payload, const char *end)
 {
-  connected = false;
-  if (millis() - last_connection_attempt > reconnect_delay)
+  StaticJsonDocument<512> command;
+  DeserializationError error = deserializeJson(command, payload, end - payload);
+  if (error)
   {
-    Serial.println("MQTT client is not connected. Try to reconnect.");
-    setError(true);
-    Serial.println("Attempting MQTT connection");
-    if (client.connect(mqtt_id, mqtt_username, mqtt_password))
-    {
-      Serial.println("Connected to MQTT server");
+    LOG_REMOTE("[JSON] Invalid command: %s", error.c_str());
+    return;
+  }
 
-      String log_message("[INFO] Connected to MQTT server");
-      client.publish(mqtt_topic_log, log_message.c_str());
+  const char *state = command["state"] | "";
+  bool turn_on = strcmp(state, "ON") == 0;
+  bool turn_off = strcmp(state, "OFF") == 0;
+  if (command.containsKey("state") && !turn_on && !turn_off)
+  {
+    LOG_REMOTE("[JSON] Illegal state");
+    return;
+  }
 
-      Serial.println("Subscribe to control topic");
-      if (client.subscribe(mqtt_topic_control))
-      {
-        Serial.println("Subscribe to color topic");
-        if (client.subscribe(mqtt_topic_color))
-        {
-          Serial.println("Subscribe to hsv topic");
-          if (client.subscribe(mqtt_topic_hsv))
-          {
-            Serial.println("Subscribe to mode topic");
-            if (client.subscribe(mqtt_topic_mode))
-            {
-              Serial.println("Subscribe to flash topic");
-              if (client.subscribe(mqtt_topic_flash))
-              {
-                Serial.println("Subscribe to progress topic");
-                if (client.subscribe(mqtt_topic_progress))
-                {
-                  setError(false);
-                  connected = true;
-                }
-                else
-                {
-                  Serial.print("Failed to subscribe to progress topic, current state = ");
-                  Serial.println(client.state());
-                  Serial.println("Try to reconnect in 5 seconds");
-                }
-              }
-              else
-              {
-                Serial.print("Failed to subscribe to flash topic, current state = ");
-                Serial.println(client.state());
-                Serial.println("Try to reconnect in 5 seconds");
-              }
-            }
-            else
-            {
-              Serial.print("Failed to subscribe to mode topic, current state = ");
-              Serial.println(client.state());
-              Serial.println("Try to reconnect in 5 seconds");
-            }
-          }
-          else
-          {
-            Serial.print("Failed to subscribe to hsv topic, current state = ");
-            Serial.println(client.state());
-            Serial.println("Try to reconnect in 5 seconds");
-          }
-        }
-        else
-        {
-          Serial.print("Failed to subscribe to color topic, current state = ");
-          Serial.println(client.state());
-          Serial.println("Try to reconnect in 5 seconds");
-        }
-      }
-      else
-      {
-        Serial.print("Failed to subscribe to control topic, current state = ");
-        Serial.println(client.state());
-        Serial.println("Try to reconnect in 5 seconds");
-      }
+  int brightness = -1;
+  if (command.containsKey("brightness"))
+  {
+    brightness = command["brightness"] | -1;
+    if (brightness < 0 || brightness > 255)
+    {
+      LOG_REMOTE("[JSON] Illegal brightness");
+      return;
+    }
+  }
+
+  int new_color = -1;
+  JsonObjectConst color = command["color"].as<JsonObjectConst>();
+  if (!color.isNull())
+  {
+    if (color.containsKey("r"))
+    {
+      new_color = pixel_color(constrain(color["r"] | 0, 0, 255), constrain(color["g"] | 0, 0, 255),
+                              constrain(color["b"] | 0, 0, 255));
+    }
+    else if (color.containsKey("h"))
+    {
+      new_color = hsv_to_rgb(color["h"] | 0.0f, (color["s"] | 0.0f) / 100, 1);
     }
     else
     {
-      Serial.print("Failed to connect to MQTT server, current state = ");
-      Serial.println(client.state());
-      Serial.println("Try to reconnect in 5 seconds");
+      LOG_REMOTE("[JSON] Illegal color");
+      return;
     }
-    last_connection_attempt = millis();
   }
-}
 
-// Input a value 0 to 255
-void showError(byte WheelPos)
-{
-  uint32_t color;
-  if (WheelPos < 127)
+  int new_mode = -1;
+  const char *effect = command["effect"] | "";
+  if (command.containsKey("effect"))
   {
-    color = pixels.Color(WheelPos, 0, 0);
+    for (int mode = 0; mode < effect_count; mode++)
+    {
+      if (strcasecmp(effects[mode]->name, effect) == 0 && mode_selectable(mode))
+        new_mode = mode;
+    }
+    if (new_mode < 0)
+    {
+      LOG_REMOTE("[JSON] Unknown effect");
+      return;
+    }
   }
-  else
+  else if (new_color >= 0)
   {
-    color = pixels.Color(255 - WheelPos, 0, 0);
+    new_mode = MODE_NORMAL;
   }
-  for (int i = 0; i < num_pixels; i++)
+
+  unsigned long transition = transition_duration;
+  if (command.containsKey("transition"))
   {
-    pixels.setPixelColor(i, color);
+    float seconds = command["transition"] | -1.0f;
+    if (!(seconds >= 0 && seconds <= max_transition / 1000.0f))
+    {
+      LOG_REMOTE("[JSON] Illegal transition");
+      return;
+    }
+    transition = seconds * 1000;
   }
-  pixels.show();
-}
 
-// Input a value 0 to 255
-void showRainbow(byte WheelPos)
-{
-  for (int i = 0; i < num_pixels; i++)
+  int rainbow_speed = json_positive(command, "rainbow_speed");
+  int space_speed = json_positive(command, "space_speed");
+  int strobo_on = json_positive(command, "strobo_on");
+  int strobo_off = json_positive(command, "strobo_off");
+  if (rainbow_speed < 0 || space_speed < 0 || strobo_on < 0 || strobo_off < 0)
   {
-    pixels.setPixelColor(i, rainbowColors[WheelPos]);
+    LOG_REMOTE("[JSON] Illegal effect speed");
+    return;
   }
-  pixels.show();
-}
 
-// Input a value 0 to 255
-void showSpace(byte WheelPos)
-{
-  for (int i = 0; i < num_pixels; i++)
+  int palette = command["palette"] | palette_selected();
+  if (!palette_available(palette))
   {
-    int interWheelPos = (WheelPos * 2 + i * 256 / num_pixels) % 256;
-    pixels.setPixelColor(i, rainbowColors[interWheelPos]);
+    LOG_REMOTE("[JSON] Unknown palette");
+    return;
   }
-  pixels.show();
-}
 
-void showProgress(int progress, int wheel_pos)
-{
-  if (progress < 0)
-    progress = 0;
-  if (progress > 100)
-    progress = 100;
-  int num_green_leds = num_pixels * double(progress) / 100;
-  int wave_pos = 0;
-  if (num_green_leds > 0)
-    wave_pos = wheel_pos % num_green_leds;
-  uint32_t color;
-  for (int i = 0; i < num_pixels; i++)
+  palette_select(palette);
+  if (rainbow_speed)
+    effects[MODE_RAINBOW]->set_parameter(PARAM_SPEED, rainbow_speed);
+  if (space_speed)
+    effects[MODE_SPACE]->set_parameter(PARAM_SPEED, space_speed);
+  if (strobo_on)
+    effects[MODE_STROBO]->set_parameter(PARAM_ON_PERIOD, strobo_on);
+  if (strobo_off)
+    effects[MODE_STROBO]->set_parameter(PARAM_OFF_PERIOD, strobo_off);
+  if (new_color >= 0)
+    effects[MODE_NORMAL]->set_parameter(PARAM_COLOR, new_color);
+
+  // Switching on and off fades the brightness over the same transition
+  // the effects crossfade with
+  if (turn_off)
   {
-    if (i < num_green_leds)
-    {
-      double gap_to_wave = wave_pos - i;
-      if (gap_to_wave < 0)
-        gap_to_wave = num_green_leds + gap_to_wave;
-      int green_val = 255 * (1 - gap_to_wave / double(num_pixels));
-      color = pixels.Color(0, green_val, 0);
-    }
-    else
-    {
-      color = pixels.Color(255, 0, 0);
-    }
-    pixels.setPixelColor(i, color);
+    if (framebuffer_brightness() > 0)
+      on_brightness = framebuffer_brightness();
+    set_brightness(0, transition);
+  }
+  else if (brightness > 0)
+  {
+    on_brightness = brightness;
+    set_brightness(brightness, transition);
   }
-  pixels.show();
+  else if (brightness == 0)
+  {
+    set_brightness(0, transition);
+  }
+  else if (turn_on && framebuffer_brightness() == 0)
+  {
+    set_brightness(on_brightness, transition);
+  }
+
+  if (new_mode >= 0 && (new_mode != current_mode || new_color >= 0))
+    apply_mode(new_mode, transition);
+
+  LOG_REMOTE("[JSON] Lamp state has been set");
+  publish_json_state();
 }
 
-void showStrobo(bool stobo_state)
+// Speeds are stored in 16 bits, slower ones come back as the slowest that
+// fits instead of wrapping around
+uint16_t stored_speed(int speed)
 {
-  uint32_t color = pixels.Color(0, 0, 0);
-  if (stobo_state)
-    color = pixels.Color(255, 255, 255);
-  for (int i = 0; i < num_pixels; i++)
-  {
-    pixels.setPixelColor(i, color);
-  }
-  pixels.show();
+  return constrain(speed, 0, 0xFFFF);
 }
 
-void showRGB(int R, int G, int B)
+// The state worth keeping over a power cycle, transient modes are
+// stored as the mode they interrupted
+PersistentState lamp_state()
 {
-  if (DEBUG_WDT)
-    Serial.println("[Show rgb] Before for loop.");
-  for (int i = 0; i < num_pixels; i++)
-  {
-    pixels.setPixelColor(i, pixels.Color(R, G, B));
-  }
-  if (DEBUG_WDT)
-    Serial.println("[Show rgb] Before pixels show.");
-  pixels.show();
+  PersistentState state;
+  memset(&state, 0, sizeof(state));
+  int mode = current_mode;
+  if (mode == MODE_ERROR)
+    mode = mode_before_error;
+  if (mode == MODE_FLASH || mode == MODE_REALTIME)
+    mode = interrupted_mode;
+  // The segment layout is not stored, so there is nothing to restore
+  if (mode == MODE_ERROR || mode == MODE_FLASH || mode == MODE_REALTIME || mode == MODE_SEGMENTS)
+    mode = default_mode;
+  state.mode = mode;
+  state.color = effects[MODE_NORMAL]->get_parameter(PARAM_COLOR);
+  state.brightness = framebuffer_brightness();
+  state.rainbow_speed = stored_speed(effects[MODE_RAINBOW]->get_parameter(PARAM_SPEED));
+  state.space_speed = stored_speed(effects[MODE_SPACE]->get_parameter(PARAM_SPEED));
+  state.strobo_on = stored_speed(effects[MODE_STROBO]->get_parameter(PARAM_ON_PERIOD));
+  state.strobo_off = stored_speed(effects[MODE_STROBO]->get_parameter(PARAM_OFF_PERIOD));
+  return state;
 }
 
-void showColor(int color)
+void restore_state()
 {
-  if (DEBUG_WDT)
-    Serial.println("[Show color] Before calc R.");
-  int R = color / (256 * 256);
-  if (DEBUG_WDT)
-    Serial.println("[Show color] Before calc G.");
-  int G = (color / 256) % 256;
-  if (DEBUG_WDT)
-    Serial.println("[Show color] Before calc B.");
-  int B = color % 256;
-  if (DEBUG_WDT)
-    Serial.println("[Show color] Before show rgb.");
-  showRGB(R, G, B);
+  PersistentState state;
+  if (!persistence_load(state))
+  {
+    LOG_INFO("No stored lamp state, start with the defaults.");
+    return;
+  }
+  effects[MODE_NORMAL]->set_parameter(PARAM_COLOR, state.color);
+  effects[MODE_RAINBOW]->set_parameter(PARAM_SPEED, state.rainbow_speed);
+  effects[MODE_SPACE]->set_parameter(PARAM_SPEED, state.space_speed);
+  effects[MODE_STROBO]->set_parameter(PARAM_ON_PERIOD, state.strobo_on);
+  effects[MODE_STROBO]->set_parameter(PARAM_OFF_PERIOD, state.strobo_off);
+  set_brightness(state.brightness);
+  if (state.brightness > 0)
+    on_brightness = state.brightness;
+  if (state.mode >= lowest_mode && state.mode <= highest_mode)
+  {
+    current_mode = state.mode;
+    effects[current_mode]->init();
+  }
+  LOG_INFO("Restored the lamp state, mode %s.", effects[current_mode]->name);
 }
 
-void handle_rot_encoder()
+// "<slot> <position> <color> [<position> <color> ...]" with positions
+// 0..255 in ascending order and decimal colors like on the color topic
+void handle_palette_message(const char *payload, const char *end)
 {
-  rot_encoder.tick();
-  int rot_new_pos = rot_encoder.getPosition();
-  if (rot_new_pos < 0)
+  int slot = parse_int(payload, end);
+  PaletteStop stops[palette_max_stops];
+  int count = 0;
+  bool valid = true;
+  while (valid && !parse_at_end(payload, end))
   {
-    rot_encoder.setPosition(0);
-    rot_new_pos = 0;
+    if (count == palette_max_stops)
+    {
+      valid = false;
+      break;
+    }
+    int position = parse_int(payload, end);
+    const char *color_start = payload;
+    int color = parse_int(payload, end);
+    valid = position >= 0 && position <= 255 && payload != color_start;
+    stops[count].position = position;
+    stops[count].color = color;
+    count++;
   }
-  else if (rot_new_pos > rotary_max)
+
+  if (valid && palette_compile(slot, stops, count))
   {
-    rot_encoder.setPosition(rotary_max);
-    rot_new_pos = rotary_max;
+    LOG_REMOTE("[PALETTE] Palette %d with %d stops has been set", slot, count);
+    publish_json_state();
   }
-  if (rot_last_pos != rot_new_pos)
+  else
   {
-    rot_last_pos = rot_new_pos;
-    float relative_pos = rot_last_pos / float(rotary_max);
-    Serial.print("Rotary encoder is set to ");
-    Serial.print((int)relative_pos * 100);
-    Serial.println("%");
-    init_warm_shade(relative_pos);
+    LOG_REMOTE("[PALETTE] Illegal palette");
   }
 }
 
-void calcRainbowColors()
+// "<length> <mode> <color> <speed> <brightness>" for each segment from
+// pixel 0 up, with the mode numbers of the mode topic. A valid layout
+// switches to the segments mode, an empty payload removes the layout.
+void handle_segments_message(const char *payload, const char *end)
 {
-  Serial.println("Calculate Rainbow Colors.");
-  for (int i = 0; i <= 255; i++)
+  const int field_count = 5;
+  SegmentConfig configs[segment_max_count];
+  int count = 0;
+  bool valid = true;
+  while (valid && !parse_at_end(payload, end))
   {
-    uint32_t color;
-    byte WheelPos = 255 - i;
-    if (WheelPos < 85)
+    if (count == segment_max_count)
     {
-      color = pixels.Color(255 - WheelPos * 3, 0, WheelPos * 3, 0);
+      valid = false;
+      break;
     }
-    else if (WheelPos < 170)
-    {
-      WheelPos -= 85;
-      color = pixels.Color(0, WheelPos * 3, 255 - WheelPos * 3, 0);
-    }
-    else
+    int fields[field_count] = {0};
+    for (int i = 0; i < field_count && valid; i++)
     {
-      WheelPos -= 170;
-      color = pixels.Color(WheelPos * 3, 255 - WheelPos * 3, 0, 0);
+      const char *field_start = payload;
+      fields[i] = parse_int(payload, end);
+      valid = payload != field_start;
     }
-    rainbowColors[i] = color;
+    configs[count] = {fields[0], fields[1], fields[2], fields[3], fields[4]};
+    count++;
   }
-  /*Serial.print("Rainbow Colors = [");
-  for (int i=0;i<=255;i++)
+
+  if (!valid || !segments_configure(configs, count))
   {
-    Serial.print(rainbowColors[i]);
-    Serial.print(",");
+    LOG_REMOTE("[SEGMENTS] Illegal segments");
+    return;
   }
-  Serial.println("]");*/
-}
-
-void loop()
-{
-  if (DEBUG_WDT)
-    Serial.println("Start loop.");
-  if (WiFi.status() != WL_CONNECTED)
+  LOG_REMOTE("[SEGMENTS] %d segments have been set", count);
+  if (count > 0)
   {
-    Serial.println("No connection to Wifi.");
-    delay(100);
+    segments_set_parameter(PARAM_PROGRESS, effects[MODE_PROGRESS]->get_parameter(PARAM_PROGRESS));
+    change_mode(MODE_SEGMENTS);
   }
-  // ESP.wdtFeed();
-
-  if (DEBUG_WDT)
-    Serial.println("Before test mqtt connection.");
-  if (WiFi.status() == WL_CONNECTED && !client.connected())
+  else if (current_mode == MODE_SEGMENTS)
   {
-    if (DEBUG_WDT)
-      Serial.println("Before reconnect.");
-    reconnect();
+    change_mode(default_mode);
   }
-  ESP.wdtFeed();
+}
 
-  if (!switch_was_pressed && !digitalRead(switch_pin))
+void handle_frame_message(const char *payload, const char *end)
+{
+  // Pushed by the next frame, which also switches to the realtime mode
+  if (!realtime_decode_frame((const uint8_t *)payload, end - payload, framebuffer, num_pixels))
+    LOG_WARN("Invalid frame payload of %d bytes", (int)(end - payload));
+}
+
+struct TopicHandler
+{
+  const char *suffix;
+  void (*handle)(const char *payload, const char *end);
+};
+
+// Topics below mqtt_topic_root the lamp reacts to
+const TopicHandler topic_handlers[] = {
+    {"color", handle_color_message},
+    {"hsv", handle_hsv_message},
+    {"flash", handle_flash_message},
+    {"progress", handle_progress_message},
+    {"control", handle_control_message},
+    {"mode", handle_mode_message},
+    {"json/set", handle_json_message},
+    {"frame", handle_frame_message},
+    {"palette", handle_palette_message},
+    {"segments", handle_segments_message},
+};
+const int topic_handler_count = sizeof(topic_handlers) / sizeof(topic_handlers[0]);
+
+// Only the command topics are subscribed, a filter on the whole root would
+// send every log, stats and state publish of the lamp back to it
+const char *mqtt_subscriptions[topic_handler_count];
+
+void mqtt_connect_command_topics()
+{
+  for (int i = 0; i < topic_handler_count; i++)
   {
-    Serial.println("Switch pressed.");
-    switch_was_pressed = true;
+    const char *suffix = topic_handlers[i].suffix;
+    char *topic = new char[mqtt_topic_root_length + 1 + strlen(suffix) + 1];
+    strcpy(topic, mqtt_topic_root);
+    topic[mqtt_topic_root_length] = '/';
+    strcpy(topic + mqtt_topic_root_length + 1, suffix);
+    mqtt_subscriptions[i] = topic;
   }
+  mqtt_connection_begin(mqtt_id, mqtt_username, mqtt_password, mqtt_subscriptions, topic_handler_count);
+}
 
-  if (switch_was_pressed && digitalRead(switch_pin))
-  {
+void mqtt_callback(char *topicChar, byte *payload, unsigned int length)
+{
+  uint32_t callback_start = telemetry_start();
+  LOG_DEBUG("Message arrived in topic [%s]: %.*s", topicChar, (int)length, (const char *)payload);
 
-    Serial.println("Switch released.");
-    int new_mode = current_mode + 1;
-    if (new_mode > highest_mode)
-      new_mode = lowest_mode;
-    Serial.println("Increase mode due to switch triggering.");
-    init_mode_change(new_mode);
-    switch_was_pressed = false;
-  }
-  // ESP.wdtFeed();
+  if (strncmp(topicChar, mqtt_topic_root, mqtt_topic_root_length) != 0 || topicChar[mqtt_topic_root_length] != '/')
+    return;
+  const char *suffix = topicChar + mqtt_topic_root_length + 1;
 
-  if (DEBUG_WDT)
-    Serial.println("Before switch mode.");
-  switch (current_mode)
-  {
-  case MODE_ERROR:
+  for (const TopicHandler &topic_handler : topic_handlers)
   {
-    if (millis() - last_error_wheel_change > error_wheel_speed)
+    if (strcmp(suffix, topic_handler.suffix) == 0)
     {
-      if (DEBUG_WDT)
-        Serial.println("Error wheel change.");
-      if (error_wheel_pos >= 255)
-        error_wheel_pos = 0;
-      else
-        error_wheel_pos++;
-      last_error_wheel_change = millis();
-      // Serial.print("Error pos = ");
-      // Serial.println(error_wheel_pos);
+      const char *command = (const char *)payload;
+      message_was_echo = false;
+      topic_handler.handle(command, command + length);
+      // Our own echoes are no client commands
+      if (boot_stats.first_command < 0 && !message_was_echo)
+      {
+        boot_stats.first_command = hal_millis();
+        LOG_INFO("Boot: first MQTT command after %ld ms", boot_stats.first_command);
+      }
+      telemetry_end(SECTION_CALLBACK, callback_start);
+      return;
     }
-    if (DEBUG_WDT)
-      Serial.println("Before show error.");
-    showError(error_wheel_pos);
-  }
-  break;
-  case MODE_NORMAL:
-  {
-    if (DEBUG_WDT)
-      Serial.println("Before show normal.");
-    showColor(current_color);
   }
-  break;
-  case MODE_FLASH:
+}
+
+void setError(bool error_occured)
+{
+  if (error_occured)
   {
-    if (millis() - last_flash_change > flash_speed)
+    LOG_INFO("Set error mode on");
+    if (current_mode != MODE_ERROR && !error_dismissed)
     {
-      if (DEBUG_WDT)
-        Serial.println("Flash change.");
-      flash_state = !flash_state;
-      if (flash_state)
-        flash_count--;
-      if (flash_count <= 0)
-        init_mode_change(mode_before_flash);
-      last_flash_change = millis();
-      /*Serial.print("flash_state = "); Serial.print(flash_state); Serial.print(" ,");
-      Serial.print("flash_count = "); Serial.print(flash_count); Serial.print(" ,");
-      Serial.print("last_flash_change = "); Serial.print(last_flash_change); Serial.print(" ,");
-      Serial.print("flash_speed = "); Serial.print(flash_speed); Serial.println();*/
+      mode_before_error = current_mode;
+      current_mode = MODE_ERROR;
     }
-    if (DEBUG_WDT)
-      Serial.println("Before show flash.");
-    if (flash_state)
-      showColor(flash_color);
-    else
-      showColor(0);
   }
-  break;
-  case MODE_RAINBOW:
+  else
   {
-    if (millis() - last_rainbow_wheel_change > rainbow_wheel_speed)
+    LOG_INFO("Set error mode off");
+    error_dismissed = false;
+    if (current_mode == MODE_ERROR)
     {
-      if (DEBUG_WDT)
-        Serial.println("Rainbow wheel change.");
-      if (rainbow_wheel_pos >= 255)
-        rainbow_wheel_pos = 0;
-      else
-        rainbow_wheel_pos++;
-      last_rainbow_wheel_change = millis();
+      current_mode = mode_before_error;
     }
-    if (DEBUG_WDT)
-      Serial.println("Before show rainbow.");
-    showRainbow(rainbow_wheel_pos);
   }
-  break;
-  case MODE_SPACE:
+}
+
+
+void handle_input_events()
+{
+  hal_input_poll();
+  int rot_new_pos = rot_last_pos;
+  unsigned long rot_event_time = 0;
+  InputEvent event;
+  while (input_queue_pop(event))
   {
-    if (millis() - last_space_wheel_change > space_wheel_speed)
+    switch (event.type)
     {
-      if (DEBUG_WDT)
-        Serial.println("Space wheel change.");
-      if (space_wheel_pos >= 255)
-        space_wheel_pos = 0;
-      else
-        space_wheel_pos++;
-      last_space_wheel_change = millis();
+    case INPUT_SWITCH_PRESSED:
+      LOG_INFO("Switch pressed.");
+      switch_was_pressed = true;
+      break;
+    case INPUT_SWITCH_RELEASED:
+      if (switch_was_pressed)
+      {
+        LOG_INFO("Switch released.");
+        int new_mode = current_mode + 1;
+        if (new_mode > highest_mode)
+          new_mode = lowest_mode;
+        LOG_INFO("Increase mode due to switch triggering.");
+        framebuffer_mark_input(event.time);
+        change_mode(new_mode);
+        switch_was_pressed = false;
+      }
+      break;
+    case INPUT_ROTATE:
+      rot_new_pos = constrain(rot_new_pos + event.steps, 0, rotary_max);
+      rot_event_time = event.time;
+      break;
     }
-    if (DEBUG_WDT)
-      Serial.println("Before show space.");
-    showSpace(space_wheel_pos);
   }
-  break;
-  case MODE_STROBO:
+
+  // Detents that arrived within one frame are applied once
+  if (rot_last_pos != rot_new_pos)
   {
-    int strobo_speed = strobo_off_period;
-    if (strobo_state)
-      strobo_speed = strobo_on_period;
-    if (millis() - last_strobo_change > strobo_speed)
+    rot_last_pos = rot_new_pos;
+    LOG_INFO("Rotary encoder is set to %d%%", rot_last_pos * 100 / rotary_max);
+    framebuffer_mark_input(rot_event_time);
+    framebuffer_set_brightness(rot_last_pos * 255 / rotary_max);
+    if (rot_last_pos > 0)
+      on_brightness = framebuffer_brightness();
+  }
+}
+
+void loop()
+{
+  LOG_TRACE("Start loop.");
+  frame_dt = frame_scheduler_start_frame();
+  uint32_t loop_start = telemetry_start();
+
+  hal_wifi_loop();
+  if (hal_wifi_connected() != wifi_was_connected)
+  {
+    wifi_was_connected = hal_wifi_connected();
+    if (!wifi_was_connected)
+    {
+      LOG_INFO("No connection to Wifi.");
+    }
+    else if (boot_stats.wifi < 0)
     {
-      if (DEBUG_WDT)
-        Serial.println("Strobo change.");
-      strobo_state = !strobo_state;
-      last_strobo_change = millis();
+      boot_stats.wifi = hal_millis();
+      LOG_INFO("Boot: Wifi connected after %ld ms", boot_stats.wifi);
     }
-    if (DEBUG_WDT)
-      Serial.println("Before show strobo.");
-    showStrobo(strobo_state);
   }
-  break;
-  case MODE_PROGRESS:
+  // hal_feed_watchdog();
+
+  LOG_TRACE("Before mqtt connection update.");
+  switch (mqtt_connection_update())
   {
-    if (millis() - last_progress_wheel_change > progress_wheel_speed)
+  case MQTT_EVENT_CONNECTED:
+    LOG_REMOTE("[INFO] Connected to MQTT server");
+    hal_set_status_led(false);
+    setError(false);
+    publish_json_state();
+    if (boot_stats.mqtt < 0)
     {
-      if (DEBUG_WDT)
-        Serial.println("Progress wheel change.");
-      if (progress_wheel_pos >= 255)
-        progress_wheel_pos = 0;
-      else
-        progress_wheel_pos++;
-      last_progress_wheel_change = millis();
+      boot_stats.mqtt = hal_millis();
+      LOG_INFO("Boot: MQTT connected after %ld ms", boot_stats.mqtt);
     }
-    showProgress(current_progress, progress_wheel_pos);
+    break;
+  case MQTT_EVENT_LOST:
+    LOG_INFO("MQTT client is not connected. Try to reconnect.");
+    hal_set_status_led(true);
+    setError(true);
+    break;
+  case MQTT_EVENT_FAILED:
+    LOG_INFO("MQTT connection failed. Keep retrying.");
+    setError(true);
+    break;
+  case MQTT_EVENT_NONE:
+    break;
   }
-  break;
+  hal_feed_watchdog();
+
+  LOG_TRACE("Before handle input events.");
+  uint32_t section_start = telemetry_start();
+  handle_input_events();
+  telemetry_end(SECTION_INPUT, section_start);
+  // hal_feed_watchdog();
+
+  LOG_TRACE("Before realtime poll.");
+  RealtimeEvent realtime_event = realtime_poll(framebuffer, num_pixels);
+  bool realtime_frame = realtime_event == REALTIME_EVENT_FRAME;
+  // Switch with the first packet, the effect must not render over it
+  if (realtime_event != REALTIME_EVENT_NONE && current_mode != MODE_REALTIME)
+  {
+    LOG_INFO("Realtime stream started.");
+    if (current_mode != MODE_FLASH)
+      interrupted_mode = current_mode == MODE_ERROR ? mode_before_error : current_mode;
+    change_mode(MODE_REALTIME);
   }
-  // ESP.wdtFeed();
-
-  if (DEBUG_WDT)
-    Serial.println("Before handle rot encoder.");
-  handle_rot_encoder();
-  // ESP.wdtFeed();
 
-  if (DEBUG_WDT)
-    Serial.println("Before mqtt loop.");
-  if (client.connected())
+  LOG_TRACE("Before render.");
+  section_start = telemetry_start();
+  // Effects that end on their own hand back to the mode they interrupted
+  if (!effects[current_mode]->update(frame_dt))
+    change_mode(interrupted_mode);
+  effects[current_mode]->render(framebuffer, num_pixels);
+  telemetry_end(SECTION_RENDER, section_start);
+  // Streamed frames are only pushed once complete, partial updates would tear
+  bool show = current_mode != MODE_REALTIME || realtime_frame;
+  if (show && current_mode == MODE_REALTIME)
+    realtime_frame_shown();
+  section_start = telemetry_start();
+  bool shown = show && framebuffer_show();
+  if (show)
+    telemetry_end(SECTION_SHOW, section_start);
+  if (shown && boot_stats.first_frame < 0)
   {
-    client.loop();
+    boot_stats.first_frame = hal_millis();
+    LOG_INFO("Boot: first frame after %ld ms", boot_stats.first_frame);
   }
-  // ESP.wdtFeed();
+  // hal_feed_watchdog();
 
-  if (switch_was_pressed)
+  LOG_TRACE("Before mqtt loop.");
+  if (hal_mqtt_connected())
   {
-    delay(3);
+    // Includes the time spent in mqtt_callback
+    section_start = telemetry_start();
+    hal_mqtt_loop();
+    telemetry_end(SECTION_MQTT, section_start);
   }
-  else
+  // hal_feed_watchdog();
+
+  if (mqtt_connection_ready() && hal_millis() - last_stats_publish >= stats_interval)
   {
-    delay(10);
+    last_stats_publish = hal_millis();
+    publish_stats();
   }
+
+  persistence_update(lamp_state());
+  telemetry_end(SECTION_LOOP, loop_start);
+
+  log_drain(frame_scheduler_remaining());
+  frame_scheduler_end_frame();
 }
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "mqtt_connection.h"
+#include "hal.h"
+#include "log.h"
+
+enum MqttConnectionState
+{
+  MQTT_WAITING,
+  MQTT_SUBSCRIBING,
+  MQTT_READY,
+};
+
+static const char *client_id = nullptr;
+static const char *client_username = nullptr;
+static const char *client_password = nullptr;
+static const char *const *client_subscriptions = nullptr;
+static int subscription_count = 0;
+// Next subscription while the session is MQTT_SUBSCRIBING
+static int next_subscription = 0;
+
+static MqttConnectionState connection_state = MQTT_WAITING;
+static unsigned long last_attempt = 0;
+// The first attempt after boot or a lost session goes out right away
+static unsigned long retry_delay = 0;
+static unsigned long consecutive_failures = 0;
+static unsigned long disconnected_since = 0;
+static unsigned long disconnected_before = 0;
+static MqttConnectionStats connection_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+
+void mqtt_connection_begin(const char *id, const char *username, const char *password,
+                           const char *const *subscriptions, int count)
+{
+  client_id = id;
+  client_username = username;
+  client_password = password;
+  client_subscriptions = subscriptions;
+  subscription_count = count;
+  disconnected_since = hal_millis();
+}
+
+// Waits between half and the full backoff so many lamps that lost the same
+// broker do not come back in lockstep
+static void schedule_retry()
+{
+  consecutive_failures++;
+  unsigned long backoff = mqtt_backoff_max;
+  if (consecutive_failures < 7)
+    backoff = mqtt_backoff_min << (consecutive_failures - 1);
+  if (backoff > mqtt_backoff_max)
+    backoff = mqtt_backoff_max;
+  retry_delay = backoff / 2 + hal_random() % (backoff / 2 + 1);
+  connection_stats.failures++;
+  connection_stats.backoff = retry_delay;
+  connection_state = MQTT_WAITING;
+}
+
+// Reported once per outage, at its first failed attempt
+static MqttConnectionEvent failure_event()
+{
+  return consecutive_failures == 1 ? MQTT_EVENT_FAILED : MQTT_EVENT_NONE;
+}
+
+static bool try_connect()
+{
+  LOG_INFO("Attempting MQTT connection");
+  connection_stats.attempts++;
+  last_attempt = hal_millis();
+  bool success = hal_mqtt_connect(client_id, client_username, client_password);
+  connection_stats.connect_time_last = hal_millis() - last_attempt;
+  if (connection_stats.connect_time_last > connection_stats.connect_time_max)
+    connection_stats.connect_time_max = connection_stats.connect_time_last;
+  if (!success)
+  {
+    LOG_WARN("Failed to connect to MQTT server, current state = %d", hal_mqtt_state());
+    schedule_retry();
+    return false;
+  }
+  connection_state = MQTT_SUBSCRIBING;
+  next_subscription = 0;
+  return true;
+}
+
+// Returns true once the last subscription went through
+static bool try_subscribe()
+{
+  const char *subscription = client_subscriptions[next_subscription];
+  LOG_INFO("Subscribe to %s", subscription);
+  unsigned long start = hal_millis();
+  bool success = hal_mqtt_subscribe(subscription);
+  connection_stats.subscribe_time_last = hal_millis() - start;
+  if (!success)
+  {
+    LOG_WARN("Failed to subscribe to %s, current state = %d", subscription, hal_mqtt_state());
+    schedule_retry();
+    return false;
+  }
+  if (++next_subscription < subscription_count)
+    return false;
+  connection_state = MQTT_READY;
+  consecutive_failures = 0;
+  retry_delay = 0;
+  connection_stats.connects++;
+  connection_stats.backoff = 0;
+  disconnected_before += hal_millis() - disconnected_since;
+  connection_stats.disconnected_time = disconnected_before;
+  return true;
+}
+
+MqttConnectionEvent mqtt_connection_update()
+{
+  bool session_up = hal_wifi_connected() && hal_mqtt_connected();
+  if (connection_state == MQTT_READY)
+  {
+    if (session_up)
+      return MQTT_EVENT_NONE;
+    connection_state = MQTT_WAITING;
+    last_attempt = hal_millis();
+    disconnected_since = last_attempt;
+    return MQTT_EVENT_LOST;
+  }
+
+  connection_stats.disconnected_time = disconnected_before + (hal_millis() - disconnected_since);
+  if (!hal_wifi_connected())
+    return MQTT_EVENT_NONE;
+
+  if (connection_state == MQTT_SUBSCRIBING)
+  {
+    if (!hal_mqtt_connected())
+    {
+      schedule_retry();
+      return failure_event();
+    }
+    if (try_subscribe())
+      return MQTT_EVENT_CONNECTED;
+    return connection_state == MQTT_WAITING ? failure_event() : MQTT_EVENT_NONE;
+  }
+
+  if (hal_millis() - last_attempt >= retry_delay && !try_connect())
+    return failure_event();
+  return MQTT_EVENT_NONE;
+}
+
+bool mqtt_connection_ready()
+{
+  return connection_state == MQTT_READY;
+}
+
+const MqttConnectionStats &mqtt_connection_stats()
+{
+  return connection_stats;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <new>
+#include "fakes.h"
+
+// Counts heap allocations on the host so benchmarks can report them per call
+
+static unsigned long allocation_count = 0;
+static unsigned long allocated_bytes = 0;
+
+void *operator new(size_t size)
+{
+  allocation_count++;
+  allocated_bytes += size;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+unsigned long fake_allocation_count()
+{
+  return allocation_count;
+}
+
+unsigned long fake_allocated_bytes()
+{
+  return allocated_bytes;
+}
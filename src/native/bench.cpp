@@ -0,0 +1,484 @@
+#include <Arduino.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "framebuffer.h"
+#include "frame_scheduler.h"
+#include "color.h"
+#include "effects.h"
+#include "palette.h"
+#include "segments.h"
+#include "fakes.h"
+#include "bench.h"
+
+void mqtt_callback(char *topicChar, byte *payload, unsigned int length);
+int hsv_to_rgb(float h, float s, float v);
+int get_color_from_hsv_command(const char *command, unsigned int length);
+
+struct BenchMessage
+{
+  std::string topic;
+  std::string payload;
+};
+
+struct BenchResult
+{
+  std::string name;
+  double ns_per_call;
+  double allocs_per_call;
+  double bytes_per_call;
+};
+
+// Every result of this run, for bench_save() and bench_check()
+static std::vector<BenchResult> results;
+
+static void bench_report(const char *name, unsigned long calls, double seconds, unsigned long allocations,
+                         unsigned long bytes)
+{
+  printf("%-28s %10.0f calls/s %10.1f ns/call %8.2f allocs/call %8.1f bytes/call\n", name, calls / seconds,
+         seconds * 1e9 / calls, allocations / double(calls), bytes / double(calls));
+  BenchResult result = {name, seconds * 1e9 / calls, allocations / double(calls), bytes / double(calls)};
+  for (BenchResult &existing : results)
+  {
+    if (existing.name == name)
+    {
+      existing = result;
+      return;
+    }
+  }
+  results.push_back(result);
+}
+
+bool bench_mqtt(unsigned long iterations)
+{
+  std::string root = fake_topic_root();
+  if (root.empty())
+  {
+    fprintf(stderr, "The lamp has not subscribed yet, run the simulator first\n");
+    return false;
+  }
+  const std::vector<BenchMessage> messages = {
+      {root + "/color", "16711680"},
+      {root + "/hsv", "25.0,0.97,0.5"},
+      {root + "/mode", "2"},
+      {root + "/progress", "42"},
+      {root + "/control", "rs 15"},
+      {root + "/control", "sts 8 100"},
+      {root + "/flash", "255 3"},
+      {root + "/unknown", "1"},
+  };
+
+  // Copy into mutable buffers up front so the loop itself does not allocate
+  std::vector<std::vector<char>> topics;
+  std::vector<std::vector<uint8_t>> payloads;
+  for (const BenchMessage &message : messages)
+  {
+    topics.emplace_back(message.topic.begin(), message.topic.end());
+    topics.back().push_back(0);
+    payloads.emplace_back(message.payload.begin(), message.payload.end());
+  }
+
+  // Without a broker connection publishes are dropped before they reach the fake
+  fake_set_broker_online(false);
+  fake_set_quiet(true);
+
+  unsigned long allocations = fake_allocation_count();
+  unsigned long bytes = fake_allocated_bytes();
+  auto start = std::chrono::steady_clock::now();
+  unsigned long calls = 0;
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    for (size_t m = 0; m < messages.size(); m++)
+    {
+      mqtt_callback(topics[m].data(), payloads[m].data(), payloads[m].size());
+      calls++;
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  fake_set_quiet(false);
+  fake_set_broker_online(true);
+
+  bench_report("mqtt_callback", calls, elapsed.count(), fake_allocation_count() - allocations,
+               fake_allocated_bytes() - bytes);
+  return true;
+}
+
+// Sustained frame rate through <root>/frame: mqtt_callback() decoding the
+// payload into the frame buffer plus the loop() that pushes it
+bool bench_frame(unsigned long iterations)
+{
+  std::string root = fake_topic_root();
+  if (root.empty())
+  {
+    fprintf(stderr, "The lamp has not subscribed yet, run the simulator first\n");
+    return false;
+  }
+  std::string topic_string = root + "/frame";
+  std::vector<char> topic(topic_string.begin(), topic_string.end());
+  topic.push_back(0);
+
+  std::vector<uint8_t> raw(num_pixels * 3);
+  for (size_t i = 0; i < raw.size(); i++)
+    raw[i] = i * 7;
+  // Eight runs of [count, r, g, b] that cover the strip
+  std::vector<uint8_t> runs;
+  for (int run = 0; run < 8; run++)
+  {
+    int count = run < 7 ? num_pixels / 8 : num_pixels - 7 * (num_pixels / 8);
+    runs.insert(runs.end(), {(uint8_t)count, (uint8_t)(run * 32), 0, (uint8_t)(255 - run * 32)});
+  }
+
+  fake_set_broker_online(false);
+  fake_set_quiet(true);
+
+  bool passed = true;
+  const char *names[] = {"frame raw", "frame run-length"};
+  std::vector<uint8_t> *payloads[] = {&raw, &runs};
+  for (int kind = 0; kind < 2; kind++)
+  {
+    std::vector<uint8_t> &payload = *payloads[kind];
+    unsigned long shows = fake_show_count();
+    unsigned long allocations = fake_allocation_count();
+    unsigned long bytes = fake_allocated_bytes();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+      // A new color every frame, so no frame is skipped as unchanged
+      payload[1] = i;
+      mqtt_callback(topic.data(), payload.data(), payload.size());
+      loop();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    unsigned long shown = fake_show_count() - shows;
+    bench_report(names[kind], iterations, elapsed.count(), fake_allocation_count() - allocations,
+                 fake_allocated_bytes() - bytes);
+    printf("%-28s %10lu of %lu frames shown\n", names[kind], shown, iterations);
+    passed &= shown == iterations;
+  }
+
+  fake_set_quiet(false);
+  fake_set_broker_online(true);
+  return passed;
+}
+
+// The float implementation hsv_to_rgb() used before the fixed-point kernel
+static int hsv_to_rgb_reference(float h, float s, float v)
+{
+  h = fmod(h, 360);
+  if (h < 0)
+    h += 360;
+
+  s = constrain(s, 0, 1);
+  v = constrain(v, 0, 1);
+
+  float c = v * s;
+  float x = c * (1 - fabs(fmod(h / 60.0, 2) - 1));
+  float m = v - c;
+
+  float r_f, g_f, b_f;
+  if (h < 60)
+    r_f = c, g_f = x, b_f = 0;
+  else if (h < 120)
+    r_f = x, g_f = c, b_f = 0;
+  else if (h < 180)
+    r_f = 0, g_f = c, b_f = x;
+  else if (h < 240)
+    r_f = 0, g_f = x, b_f = c;
+  else if (h < 300)
+    r_f = x, g_f = 0, b_f = c;
+  else
+    r_f = c, g_f = 0, b_f = x;
+
+  uint8_t r = (r_f + m) * 255;
+  uint8_t g = (g_f + m) * 255;
+  uint8_t b = (b_f + m) * 255;
+
+  return r * 256 * 256 + g * 256 + b;
+}
+
+// hsv_to_rgb() against the float reference it replaced and the kernel
+// behind it. The accuracy is checked in test/test_native/test_color.cpp.
+bool bench_hsv(unsigned long iterations)
+{
+  volatile uint32_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink = sink + hsv_to_rgb_reference(i % 360, 0.97f, (i & 0xFF) / 255.0f);
+  std::chrono::duration<double> reference_elapsed = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink = sink + hsv_to_rgb(i % 360, 0.97f, (i & 0xFF) / 255.0f);
+  std::chrono::duration<double> wrapper_elapsed = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink = sink + hsv_to_rgb_fixed(i * 182, 31785, (i & 0xFF) << 7);
+  std::chrono::duration<double> fixed_elapsed = std::chrono::steady_clock::now() - start;
+
+  bench_report("hsv_to_rgb (float ref)", iterations, reference_elapsed.count(), 0, 0);
+  bench_report("hsv_to_rgb", iterations, wrapper_elapsed.count(), 0, 0);
+  bench_report("hsv_to_rgb_fixed", iterations, fixed_elapsed.count(), 0, 0);
+  return true;
+}
+
+// Layout of the segment benchmarks
+static const SegmentConfig bench_layout[] = {
+    {num_pixels / 3, MODE_PROGRESS, 0, 0, 255},
+    {num_pixels / 3, MODE_RAINBOW, 0, 20, 128},
+    {num_pixels - 2 * (num_pixels / 3), MODE_SPACE, 0, 1, 255},
+};
+static const int bench_layout_count = sizeof(bench_layout) / sizeof(bench_layout[0]);
+
+// Cost of one frame of every effect, update and render separately. The
+// segments mode runs the layout of bench_segments().
+bool bench_effects(unsigned long iterations)
+{
+  static uint32_t pixels[num_pixels];
+  segments_configure(bench_layout, bench_layout_count);
+  for (int mode = 0; mode < effect_count; mode++)
+  {
+    Effect *effect = effects[mode];
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+      effect->update(frame_period);
+    std::chrono::duration<double> update_elapsed = std::chrono::steady_clock::now() - start;
+
+    unsigned long allocations = fake_allocation_count();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+      effect->render(pixels, num_pixels);
+    std::chrono::duration<double> render_elapsed = std::chrono::steady_clock::now() - start;
+    allocations = fake_allocation_count() - allocations;
+
+    std::string name = std::string(effect->name) + " update";
+    bench_report(name.c_str(), iterations, update_elapsed.count(), 0, 0);
+    name = std::string(effect->name) + " render";
+    bench_report(name.c_str(), iterations, render_elapsed.count(), allocations, 0);
+  }
+  segments_configure(nullptr, 0);
+  return true;
+}
+
+// framebuffer_show() for a frame of one color and for a gradient, forced
+// out every time so the dirty check does not skip it
+bool bench_show(unsigned long iterations)
+{
+  const char *names[] = {"show uniform", "show gradient"};
+  for (int kind = 0; kind < 2; kind++)
+  {
+    for (int i = 0; i < num_pixels; i++)
+      framebuffer[i] = kind == 0 ? rainbow_color(40) : rainbow_color(i * 3);
+    unsigned long allocations = fake_allocation_count();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+      framebuffer_invalidate();
+      framebuffer_show();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    allocations = fake_allocation_count() - allocations;
+    bench_report(names[kind], iterations, elapsed.count(), allocations, 0);
+  }
+  return true;
+}
+
+// One rainbow wheel color and parsing a <root>/hsv payload
+bool bench_color(unsigned long iterations)
+{
+  fake_set_quiet(true);
+  volatile uint32_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink = sink + rainbow_color(i);
+  std::chrono::duration<double> rainbow_elapsed = std::chrono::steady_clock::now() - start;
+
+  const char command[] = "25.0,0.97,0.5";
+  unsigned long allocations = fake_allocation_count();
+  unsigned long bytes = fake_allocated_bytes();
+  start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink = sink + get_color_from_hsv_command(command, sizeof(command) - 1);
+  std::chrono::duration<double> command_elapsed = std::chrono::steady_clock::now() - start;
+  allocations = fake_allocation_count() - allocations;
+  bytes = fake_allocated_bytes() - bytes;
+  fake_set_quiet(false);
+
+  bench_report("rainbow_color", iterations, rainbow_elapsed.count(), 0, 0);
+  bench_report("get_color_from_hsv_command", iterations, command_elapsed.count(), allocations, bytes);
+  return true;
+}
+
+// Compiling a gradient with the maximum number of stops, and rendering the
+// space mode with it against the built-in wheel
+bool bench_palette(unsigned long iterations)
+{
+  PaletteStop stops[palette_max_stops];
+  for (int i = 0; i < palette_max_stops; i++)
+    stops[i] = {(uint8_t)(i * 255 / (palette_max_stops - 1)), rainbow_color(i * 16)};
+
+  int previous = palette_selected();
+  // The first upload allocates the table of the slot
+  palette_compile(palette_slots, stops, palette_max_stops);
+  unsigned long allocations = fake_allocation_count();
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+    palette_compile(palette_slots, stops, palette_max_stops);
+  std::chrono::duration<double> compile_elapsed = std::chrono::steady_clock::now() - start;
+  allocations = fake_allocation_count() - allocations;
+  bench_report("palette compile", iterations, compile_elapsed.count(), allocations, 0);
+
+  static uint32_t pixels[num_pixels];
+  const char *names[] = {"SPACE render wheel", "SPACE render palette"};
+  const int slots[] = {0, palette_slots};
+  for (int kind = 0; kind < 2; kind++)
+  {
+    palette_select(slots[kind]);
+    start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+      effects[MODE_SPACE]->render(pixels, num_pixels);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    bench_report(names[kind], iterations, elapsed.count(), 0, 0);
+  }
+  palette_select(previous);
+  return true;
+}
+
+// One frame of the effect
+static double bench_frame_seconds(Effect *effect, unsigned long iterations)
+{
+  static uint32_t pixels[num_pixels];
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++)
+  {
+    effect->update(frame_period);
+    effect->render(pixels, num_pixels);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Progress on the bottom third, a rainbow at half brightness and space
+// above it, against the most expensive of the same effects on the whole
+// strip. Fails if the segments cost more. Both sides are measured in turns
+// and the best round counts, so a slower stretch of the host hits both.
+bool bench_segments(unsigned long iterations)
+{
+  segments_configure(bench_layout, bench_layout_count);
+  segments_set_parameter(PARAM_PROGRESS, 60);
+  int progress = effects[MODE_PROGRESS]->get_parameter(PARAM_PROGRESS);
+  effects[MODE_PROGRESS]->set_parameter(PARAM_PROGRESS, 60);
+
+  const int rounds = 5;
+  double segments_best = 0;
+  double full_strip_best[bench_layout_count] = {0};
+  unsigned long allocations = 0;
+  for (int round = 0; round < rounds; round++)
+  {
+    unsigned long round_allocations = fake_allocation_count();
+    double elapsed = bench_frame_seconds(effects[MODE_SEGMENTS], iterations / rounds);
+    if (round == 0)
+      allocations = fake_allocation_count() - round_allocations;
+    if (round == 0 || elapsed < segments_best)
+      segments_best = elapsed;
+    for (int i = 0; i < bench_layout_count; i++)
+    {
+      elapsed = bench_frame_seconds(effects[bench_layout[i].mode], iterations / rounds);
+      if (round == 0 || elapsed < full_strip_best[i])
+        full_strip_best[i] = elapsed;
+    }
+  }
+  double full_strip = 0;
+  for (int i = 0; i < bench_layout_count; i++)
+  {
+    if (full_strip_best[i] > full_strip)
+      full_strip = full_strip_best[i];
+  }
+  segments_configure(nullptr, 0);
+  effects[MODE_PROGRESS]->set_parameter(PARAM_PROGRESS, progress);
+
+  unsigned long calls = iterations / rounds;
+  bench_report("segments frame", calls, segments_best, allocations, 0);
+  bench_report("full strip frame", calls, full_strip, 0, 0);
+  bool passed = segments_best <= full_strip;
+  if (!passed)
+    fprintf(stderr, "The segments cost more than one full strip frame\n");
+  return passed;
+}
+
+bool bench_save(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (!file)
+  {
+    fprintf(stderr, "Cannot write %s\n", path);
+    return false;
+  }
+  fprintf(file, "name,ns_per_call,allocs_per_call,bytes_per_call\n");
+  for (const BenchResult &result : results)
+    fprintf(file, "%s,%.1f,%.4f,%.1f\n", result.name.c_str(), result.ns_per_call, result.allocs_per_call,
+            result.bytes_per_call);
+  fclose(file);
+  printf("Wrote %zu results to %s\n", results.size(), path);
+  return true;
+}
+
+// Each threshold line is "<name> <max ns/call> <max allocs/call>", the name
+// may contain spaces. Benchmarks without a threshold are not checked, a
+// threshold without a result fails so renamed benchmarks are noticed.
+bool bench_check(const char *path)
+{
+  std::ifstream file(path);
+  if (!file)
+  {
+    fprintf(stderr, "Cannot read %s\n", path);
+    return false;
+  }
+  bool passed = true;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    std::vector<std::string> words;
+    std::string word;
+    while (fields >> word)
+      words.push_back(word);
+    if (words.size() < 3)
+    {
+      fprintf(stderr, "Malformed threshold: %s\n", line.c_str());
+      passed = false;
+      continue;
+    }
+    double max_ns = atof(words[words.size() - 2].c_str());
+    double max_allocs = atof(words[words.size() - 1].c_str());
+    std::string name = words[0];
+    for (size_t i = 1; i < words.size() - 2; i++)
+      name += " " + words[i];
+
+    const BenchResult *result = nullptr;
+    for (const BenchResult &candidate : results)
+    {
+      if (candidate.name == name)
+        result = &candidate;
+    }
+    if (!result)
+    {
+      printf("MISSING %s\n", name.c_str());
+      passed = false;
+    }
+    else if (result->ns_per_call > max_ns || result->allocs_per_call > max_allocs)
+    {
+      printf("REGRESSED %-28s %10.1f ns/call (max %.1f) %8.2f allocs/call (max %.2f)\n", name.c_str(),
+             result->ns_per_call, max_ns, result->allocs_per_call, max_allocs);
+      passed = false;
+    }
+  }
+  printf("Thresholds from %s %s\n", path, passed ? "passed" : "FAILED");
+  return passed;
+}
@@ -0,0 +1,21 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Host benchmarks, run through the simulator's bench command. They return
+// false when a result is out of its allowed range. Correctness is checked
+// by the unit tests in test/test_native.
+
+bool bench_mqtt(unsigned long iterations);
+bool bench_hsv(unsigned long iterations);
+bool bench_effects(unsigned long iterations);
+bool bench_frame(unsigned long iterations);
+bool bench_color(unsigned long iterations);
+bool bench_show(unsigned long iterations);
+bool bench_palette(unsigned long iterations);
+bool bench_segments(unsigned long iterations);
+
+// Results of all benchmarks run so far, as CSV or against a threshold file
+bool bench_save(const char *path);
+bool bench_check(const char *path);
+
+#endif
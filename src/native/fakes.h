@@ -0,0 +1,22 @@
+#ifndef FAKES_H
+#define FAKES_H
+
+#include <stdint.h>
+#include <string>
+
+// Controls for the fake hardware in hal_native.cpp, used by the simulator.
+
+void fake_advance_millis(unsigned long ms);
+void fake_set_switch(bool pressed);
+void fake_rotate(int steps);
+void fake_set_wifi_connected(bool connected);
+void fake_set_broker_online(bool online);
+void fake_broker_inject(const char *topic, const char *payload);
+std::string fake_topic_root();
+uint32_t fake_pixel(int index);
+unsigned long fake_show_count();
+void fake_set_quiet(bool quiet);
+unsigned long fake_allocation_count();
+unsigned long fake_allocated_bytes();
+
+#endif
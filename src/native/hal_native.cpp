@@ -0,0 +1,366 @@
+#include <Arduino.h>
+#include <chrono>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "hal.h"
+#include "input_queue.h"
+#include "fakes.h"
+
+HardwareSerial Serial;
+
+// Fake clock: time only moves when the firmware delays or the simulator advances it
+static unsigned long fake_millis = 0;
+
+
+static uint32_t fake_pixels[num_pixels];
+static uint32_t fake_shown_pixels[num_pixels];
+static unsigned long fake_shows = 0;
+
+// Contents of the fake flash, empty until the first write
+static std::vector<uint8_t> fake_storage;
+
+static bool fake_wifi_connected = true;
+// Time the fake station needs to associate after hal_wifi_begin()
+static const unsigned long fake_wifi_connect_time = 200;
+static unsigned long fake_wifi_up_at = 0;
+
+// Real UDP socket on the host, so a local sender can stream to the simulator
+static int fake_udp_socket = -1;
+static uint8_t fake_udp_packet[1500];
+static int fake_udp_length = 0;
+static int fake_udp_position = 0;
+
+// Local broker stand-in: routes publishes to the subscriptions of the lamp
+struct FakeMessage
+{
+  std::string topic;
+  std::string payload;
+};
+
+static bool fake_broker_online = true;
+static bool fake_mqtt_connected = false;
+static hal_mqtt_callback_t fake_mqtt_callback = nullptr;
+static std::vector<std::string> fake_subscriptions;
+static std::deque<FakeMessage> fake_inbox;
+
+unsigned long hal_millis()
+{
+  return fake_millis;
+}
+
+void hal_delay(unsigned long ms)
+{
+  fake_millis += ms;
+}
+
+void hal_feed_watchdog()
+{
+}
+
+uint32_t hal_random()
+{
+  return rand();
+}
+
+// The host counts nanoseconds instead of cycles
+uint32_t hal_cycle_count()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint32_t hal_cycles_per_us()
+{
+  return 1000;
+}
+
+uint32_t hal_free_heap()
+{
+  return 40000;
+}
+
+uint32_t hal_max_free_block()
+{
+  return 32000;
+}
+
+uint8_t hal_heap_fragmentation()
+{
+  return 20;
+}
+
+const char *hal_reset_reason()
+{
+  return "Power On";
+}
+
+void hal_gpio_setup()
+{
+}
+
+void hal_set_status_led(bool on)
+{
+}
+
+void hal_input_begin()
+{
+}
+
+void hal_input_poll()
+{
+}
+
+void hal_pixels_begin()
+{
+}
+
+void hal_pixels_write(const uint32_t *colors)
+{
+  memcpy(fake_pixels, colors, sizeof(fake_pixels));
+}
+
+void hal_pixels_fill(uint32_t color)
+{
+  for (int i = 0; i < num_pixels; i++)
+    fake_pixels[i] = color;
+}
+
+void hal_pixels_show()
+{
+  memcpy(fake_shown_pixels, fake_pixels, sizeof(fake_pixels));
+  fake_shows++;
+}
+
+void hal_storage_begin(unsigned int size)
+{
+  // Like EEPROM.begin(), take the memory up front so writes never allocate
+  fake_storage.reserve(size);
+}
+
+bool hal_storage_read(void *data, unsigned int size)
+{
+  if (fake_storage.size() < size)
+    return false;
+  memcpy(data, fake_storage.data(), size);
+  return true;
+}
+
+bool hal_storage_write(const void *data, unsigned int size)
+{
+  fake_storage.assign((const uint8_t *)data, (const uint8_t *)data + size);
+  return true;
+}
+
+void hal_wifi_begin()
+{
+  fake_wifi_up_at = fake_millis + fake_wifi_connect_time;
+}
+
+void hal_wifi_loop()
+{
+}
+
+bool hal_wifi_connected()
+{
+  return fake_wifi_connected && fake_millis >= fake_wifi_up_at;
+}
+
+int8_t hal_wifi_rssi()
+{
+  return hal_wifi_connected() ? -60 - (int)(fake_millis / 10000 % 5) : 31;
+}
+
+void hal_udp_begin(uint16_t port)
+{
+  fake_udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (fake_udp_socket < 0 || bind(fake_udp_socket, (sockaddr *)&address, sizeof(address)) != 0)
+  {
+    fprintf(stderr, "UDP port %u is not available, realtime streaming is off\n", port);
+    if (fake_udp_socket >= 0)
+      close(fake_udp_socket);
+    fake_udp_socket = -1;
+    return;
+  }
+  fcntl(fake_udp_socket, F_SETFL, O_NONBLOCK);
+}
+
+int hal_udp_parse()
+{
+  if (fake_udp_socket < 0)
+    return 0;
+  ssize_t length = recv(fake_udp_socket, fake_udp_packet, sizeof(fake_udp_packet), 0);
+  fake_udp_length = length > 0 ? length : 0;
+  fake_udp_position = 0;
+  return fake_udp_length;
+}
+
+int hal_udp_read(void *data, int size)
+{
+  int available = fake_udp_length - fake_udp_position;
+  if (size > available)
+    size = available;
+  memcpy(data, fake_udp_packet + fake_udp_position, size);
+  fake_udp_position += size;
+  return size;
+}
+
+void hal_mqtt_setup(const char *server_address, uint16_t server_port, hal_mqtt_callback_t callback)
+{
+  fake_mqtt_callback = callback;
+}
+
+bool hal_mqtt_connect(const char *id, const char *username, const char *password)
+{
+  fake_subscriptions.clear();
+  fake_mqtt_connected = fake_broker_online;
+  return fake_mqtt_connected;
+}
+
+bool hal_mqtt_connected()
+{
+  return fake_mqtt_connected;
+}
+
+int hal_mqtt_state()
+{
+  // Mirrors PubSubClient: 0 = connected, -2 = connect failed
+  return fake_mqtt_connected ? 0 : -2;
+}
+
+bool hal_mqtt_subscribe(const char *topic)
+{
+  if (!fake_mqtt_connected)
+    return false;
+  fake_subscriptions.push_back(topic);
+  return true;
+}
+
+// MQTT topic filter matching with the + and # wildcards
+static bool fake_topic_matches(const std::string &filter, const std::string &topic)
+{
+  size_t f = 0;
+  size_t t = 0;
+  while (f < filter.size())
+  {
+    if (filter[f] == '#')
+      return true;
+    if (filter[f] == '+')
+    {
+      while (t < topic.size() && topic[t] != '/')
+        t++;
+      f++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t])
+      return false;
+    f++;
+    t++;
+  }
+  return t == topic.size();
+}
+
+static bool fake_is_subscribed(const std::string &topic)
+{
+  for (const std::string &subscription : fake_subscriptions)
+  {
+    if (fake_topic_matches(subscription, topic))
+      return true;
+  }
+  return false;
+}
+
+bool hal_mqtt_publish(const char *topic, const char *payload)
+{
+  if (!fake_mqtt_connected)
+    return false;
+  printf("[broker] %s %s\n", topic, payload);
+  if (fake_is_subscribed(topic))
+    fake_inbox.push_back({topic, payload});
+  return true;
+}
+
+void hal_mqtt_loop()
+{
+  // Only deliver what was queued before this call, like one network poll
+  size_t pending = fake_inbox.size();
+  for (size_t i = 0; i < pending && fake_mqtt_connected; i++)
+  {
+    FakeMessage message = fake_inbox.front();
+    fake_inbox.pop_front();
+    std::vector<char> topic(message.topic.begin(), message.topic.end());
+    topic.push_back(0);
+    std::vector<uint8_t> payload(message.payload.begin(), message.payload.end());
+    payload.push_back(0);
+    if (fake_mqtt_callback)
+      fake_mqtt_callback(topic.data(), payload.data(), message.payload.size());
+  }
+}
+
+void fake_advance_millis(unsigned long ms)
+{
+  fake_millis += ms;
+}
+
+void fake_set_switch(bool pressed)
+{
+  input_queue_push(pressed ? INPUT_SWITCH_PRESSED : INPUT_SWITCH_RELEASED, 0, fake_millis);
+}
+
+void fake_rotate(int steps)
+{
+  // One event per detent, like the encoder interrupt
+  for (int i = 0; i < abs(steps); i++)
+    input_queue_push(INPUT_ROTATE, steps > 0 ? 1 : -1, fake_millis);
+}
+
+void fake_set_wifi_connected(bool connected)
+{
+  fake_wifi_connected = connected;
+}
+
+void fake_set_broker_online(bool online)
+{
+  fake_broker_online = online;
+  if (!online)
+    fake_mqtt_connected = false;
+}
+
+void fake_broker_inject(const char *topic, const char *payload)
+{
+  if (fake_is_subscribed(topic))
+    fake_inbox.push_back({topic, payload});
+}
+
+// Topic root the lamp subscribed under, empty while it never connected
+std::string fake_topic_root()
+{
+  if (fake_subscriptions.empty())
+    return "";
+  const std::string &topic = fake_subscriptions.front();
+  return topic.substr(0, topic.rfind('/'));
+}
+
+uint32_t fake_pixel(int index)
+{
+  return fake_shown_pixels[index];
+}
+
+unsigned long fake_show_count()
+{
+  return fake_shows;
+}
+
+void fake_set_quiet(bool quiet)
+{
+  Serial.quiet = quiet;
+}
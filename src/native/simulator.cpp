@@ -0,0 +1,200 @@
+#include <Arduino.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "hal.h"
+#include "framebuffer.h"
+#include "frame_scheduler.h"
+#include "input_queue.h"
+#include "mqtt_connection.h"
+#include "persistence.h"
+#include "realtime.h"
+#include "fakes.h"
+#include "bench.h"
+
+// Host simulator for the lamp firmware. It listens for DDP on 127.0.0.1, so
+// tools/ddp_send.py can stream to it. Reads commands from stdin, one per line:
+//   run <ms>                  run loop() until <ms> of fake time have passed
+//   pub <topic> <payload>     deliver a message through the local broker
+//   press | release           operate the switch
+//   rotate <steps>            turn the rotary encoder
+//   wifi on|off               connect or drop WiFi
+//   broker on|off             start or stop the broker
+//   pixels                    print the last shown frame
+//   shows                     print pushed and skipped frames, the input-to-light latency and the power draw
+//   frames                    print the frame scheduler statistics
+//   inputs                    print the input events lost to queue overflow
+//   mqtt                      print the MQTT connection statistics
+//   storage                   print the flash write statistics
+//   realtime                  print the UDP streaming counters
+//   bench mqtt [iterations]   benchmark mqtt_callback() dispatch
+//   bench hsv [iterations]    benchmark hsv_to_rgb() against its float reference
+//   bench effects [iterations] measure update and render cost of every effect
+//   bench frame [iterations]  frames per second through the <root>/frame topic
+//   bench color [iterations]  benchmark rainbow_color() and get_color_from_hsv_command()
+//   bench show [iterations]   cost of framebuffer_show() for a uniform and a gradient frame
+//   bench palette [iterations] cost of compiling a palette and of rendering with it
+//   bench segments [iterations] cost of three segments against one full strip effect
+//   bench all [iterations]    run every benchmark above
+//   bench save <file>         write the benchmark results as CSV
+//   bench check <file>        fail if a result exceeds its threshold, see tools/bench_thresholds.txt
+// The exit code is 1 if a benchmark failed.
+
+// The unit tests bring their own main()
+#ifndef PIO_UNIT_TESTING
+static void run_for(unsigned long ms)
+{
+  unsigned long start = hal_millis();
+  while (hal_millis() - start < ms)
+  {
+    unsigned long before = hal_millis();
+    loop();
+    if (hal_millis() == before)
+      fake_advance_millis(1);
+  }
+}
+
+static void print_pixels()
+{
+  for (int i = 0; i < num_pixels; i++)
+  {
+    printf("%06x%c", (unsigned int)fake_pixel(i), (i + 1) % 16 == 0 ? '\n' : ' ');
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  setup();
+
+  bool failed = false;
+  std::string line;
+  while (std::getline(std::cin, line))
+  {
+    std::istringstream words(line);
+    std::string command;
+    words >> command;
+    if (command.empty() || command[0] == '#')
+      continue;
+
+    if (command == "run")
+    {
+      unsigned long ms = 0;
+      words >> ms;
+      run_for(ms);
+    }
+    else if (command == "pub")
+    {
+      std::string topic;
+      std::string payload;
+      words >> topic;
+      std::getline(words >> std::ws, payload);
+      fake_broker_inject(topic.c_str(), payload.c_str());
+    }
+    else if (command == "press" || command == "release")
+    {
+      fake_set_switch(command == "press");
+    }
+    else if (command == "rotate")
+    {
+      int steps = 0;
+      words >> steps;
+      fake_rotate(steps);
+    }
+    else if (command == "wifi" || command == "broker")
+    {
+      std::string state;
+      words >> state;
+      if (command == "wifi")
+        fake_set_wifi_connected(state == "on");
+      else
+        fake_set_broker_online(state == "on");
+    }
+    else if (command == "pixels")
+    {
+      print_pixels();
+    }
+    else if (command == "shows")
+    {
+      const FrameStats &stats = framebuffer_stats();
+      printf("shows=%lu pushed=%lu skipped=%lu input_latency=%lu input_latency_max=%lu\n", fake_show_count(),
+             stats.pushed, stats.skipped, stats.input_latency_last, stats.input_latency_max);
+      printf("power=%umA requested=%umA max=%umA limited=%lu\n", (unsigned int)stats.power_ma,
+             (unsigned int)stats.power_requested_ma, (unsigned int)stats.power_max_ma, stats.power_limited);
+    }
+    else if (command == "frames")
+    {
+      const FrameSchedulerStats &stats = frame_scheduler_stats();
+      printf("frames=%lu missed=%lu dropped=%lu max_frame_time=%lu\n", stats.frames, stats.missed_deadlines,
+             stats.dropped_frames, stats.max_frame_time);
+    }
+    else if (command == "inputs")
+    {
+      printf("input_overflows=%lu\n", input_queue_overflows());
+    }
+    else if (command == "mqtt")
+    {
+      const MqttConnectionStats &stats = mqtt_connection_stats();
+      printf("mqtt_ready=%d attempts=%lu failures=%lu connects=%lu connect_time=%lu connect_time_max=%lu "
+             "subscribe_time=%lu disconnected_time=%lu backoff=%lu\n",
+             mqtt_connection_ready(), stats.attempts, stats.failures, stats.connects, stats.connect_time_last,
+             stats.connect_time_max, stats.subscribe_time_last, stats.disconnected_time, stats.backoff);
+    }
+    else if (command == "storage")
+    {
+      const PersistenceStats &stats = persistence_stats();
+      printf("writes=%lu bytes_written=%lu write_errors=%lu coalesced=%lu\n", stats.writes, stats.bytes_written,
+             stats.write_errors, stats.coalesced);
+    }
+    else if (command == "realtime")
+    {
+      const RealtimeStats &stats = realtime_stats();
+      printf("received=%lu shown=%lu dropped=%lu late=%lu invalid=%lu\n", stats.received, stats.shown, stats.dropped,
+             stats.late, stats.invalid);
+    }
+    else if (command == "bench")
+    {
+      std::string target;
+      words >> target;
+      if (target == "save" || target == "check")
+      {
+        std::string path;
+        words >> path;
+        failed |= !(target == "save" ? bench_save(path.c_str()) : bench_check(path.c_str()));
+        continue;
+      }
+      unsigned long iterations = 100000;
+      words >> iterations;
+      bool passed = false;
+      if (target == "all")
+        passed = bench_mqtt(iterations) & bench_hsv(iterations) & bench_effects(iterations) &
+                 bench_color(iterations) & bench_show(iterations) & bench_palette(iterations) &
+                 bench_segments(iterations) & bench_frame(iterations);
+      else if (target == "mqtt")
+        passed = bench_mqtt(iterations);
+      else if (target == "hsv")
+        passed = bench_hsv(iterations);
+      else if (target == "effects")
+        passed = bench_effects(iterations);
+      else if (target == "frame")
+        passed = bench_frame(iterations);
+      else if (target == "color")
+        passed = bench_color(iterations);
+      else if (target == "show")
+        passed = bench_show(iterations);
+      else if (target == "palette")
+        passed = bench_palette(iterations);
+      else if (target == "segments")
+        passed = bench_segments(iterations);
+      else
+        fprintf(stderr, "Unknown benchmark: %s\n", target.c_str());
+      failed |= !passed;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown simulator command: %s\n", command.c_str());
+    }
+  }
+  return failed ? 1 : 0;
+}
+#endif
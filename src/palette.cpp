@@ -0,0 +1,70 @@
+#include <new>
+#include "palette.h"
+
+const uint32_t *palette_table = nullptr;
+
+static uint32_t *slot_tables[palette_slots + 1] = {nullptr};
+static int selected_slot = 0;
+
+bool palette_compile(int slot, const PaletteStop *stops, int count)
+{
+  if (slot < 1 || slot > palette_slots || count < 1 || count > palette_max_stops)
+    return false;
+  for (int i = 1; i < count; i++)
+  {
+    if (stops[i].position < stops[i - 1].position)
+      return false;
+  }
+
+  // Allocated once and reused by later uploads, so the heap does not churn
+  // Exceptions are off on the ESP8266, a failed new has to return nullptr
+  if (!slot_tables[slot])
+    slot_tables[slot] = new (std::nothrow) uint32_t[256];
+  if (!slot_tables[slot])
+    return false;
+  uint32_t *table = slot_tables[slot];
+
+  // next is the first stop past the current index
+  int next = 0;
+  for (int i = 0; i < 256; i++)
+  {
+    while (next < count && stops[next].position <= i)
+      next++;
+    if (next == 0)
+    {
+      table[i] = stops[0].color;
+    }
+    else if (next == count)
+    {
+      table[i] = stops[count - 1].color;
+    }
+    else
+    {
+      const PaletteStop &from = stops[next - 1];
+      const PaletteStop &to = stops[next];
+      int32_t weight = (i - from.position) * 256 / (to.position - from.position);
+      table[i] = blend_channel(from.color, to.color, 16, weight) | blend_channel(from.color, to.color, 8, weight) |
+                 blend_channel(from.color, to.color, 0, weight);
+    }
+  }
+  return palette_select(slot);
+}
+
+bool palette_available(int slot)
+{
+  return slot == 0 || (slot > 0 && slot <= palette_slots && slot_tables[slot]);
+}
+
+bool palette_select(int slot)
+{
+  if (!palette_available(slot))
+    return false;
+  selected_slot = slot;
+  palette_table = slot_tables[slot];
+  return true;
+}
+
+int palette_selected()
+{
+  return selected_slot;
+}
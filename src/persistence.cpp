@@ -0,0 +1,90 @@
+#include <string.h>
+#include "persistence.h"
+#include "hal.h"
+#include "log.h"
+
+const uint16_t persist_magic = 0x4c53;
+const uint8_t persist_version = 1;
+
+struct PersistentRecord
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t checksum;
+  PersistentState state;
+};
+
+static PersistentState written_state;
+static PersistentState pending_state;
+static bool state_known = false;
+static unsigned long last_change = 0;
+static PersistenceStats storage_stats = {0, 0, 0, 0};
+
+static uint8_t state_checksum(const PersistentState &state)
+{
+  const uint8_t *bytes = (const uint8_t *)&state;
+  uint8_t sum = 0;
+  for (size_t i = 0; i < sizeof(state); i++)
+    sum = (sum << 1 | sum >> 7) ^ bytes[i];
+  return sum;
+}
+
+bool persistence_load(PersistentState &state)
+{
+  hal_storage_begin(sizeof(PersistentRecord));
+  PersistentRecord record;
+  if (!hal_storage_read(&record, sizeof(record)) || record.magic != persist_magic ||
+      record.version != persist_version || record.checksum != state_checksum(record.state))
+    return false;
+  state = record.state;
+  written_state = state;
+  pending_state = state;
+  state_known = true;
+  return true;
+}
+
+void persistence_update(const PersistentState &state)
+{
+  if (!state_known)
+  {
+    // Nothing stored yet, the first state seen is the baseline
+    memset(&written_state, 0xFF, sizeof(written_state));
+    pending_state = state;
+    state_known = true;
+    last_change = hal_millis();
+  }
+  else if (memcmp(&state, &pending_state, sizeof(state)) != 0)
+  {
+    if (memcmp(&pending_state, &written_state, sizeof(pending_state)) != 0)
+      storage_stats.coalesced++;
+    pending_state = state;
+    last_change = hal_millis();
+  }
+
+  if (memcmp(&pending_state, &written_state, sizeof(pending_state)) == 0 ||
+      hal_millis() - last_change < persist_quiet_period)
+    return;
+
+  PersistentRecord record;
+  memset(&record, 0, sizeof(record));
+  record.magic = persist_magic;
+  record.version = persist_version;
+  record.state = pending_state;
+  record.checksum = state_checksum(record.state);
+  // A failed write is not retried before the state changes again
+  written_state = pending_state;
+  if (!hal_storage_write(&record, sizeof(record)))
+  {
+    storage_stats.write_errors++;
+    LOG_WARN("Failed to store the lamp state");
+    return;
+  }
+  storage_stats.writes++;
+  storage_stats.bytes_written += sizeof(record);
+  LOG_DEBUG("Stored the lamp state");
+}
+
+const PersistenceStats &persistence_stats()
+{
+  return storage_stats;
+}
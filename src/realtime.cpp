@@ -0,0 +1,180 @@
+#include "realtime.h"
+#include "hal.h"
+#include "log.h"
+
+// DDP header, see http://www.3waylabs.com/ddp/
+const int ddp_header_length = 10;
+const uint8_t ddp_version_mask = 0xC0;
+const uint8_t ddp_version_1 = 0x40;
+const uint8_t ddp_flag_timecode = 0x10;
+const uint8_t ddp_flag_query = 0x02;
+const uint8_t ddp_flag_push = 0x01;
+const uint8_t ddp_id_display = 1;
+
+static uint8_t last_sequence = 0;
+static unsigned long last_packet = 0;
+static bool frame_pending = false;
+// Set by an MQTT frame, which arrives outside of realtime_poll()
+static bool frame_completed = false;
+static RealtimeStats stats = {0, 0, 0, 0, 0};
+
+void realtime_begin()
+{
+  hal_udp_begin(ddp_port);
+}
+
+// Sequence numbers run from 1 to 15, 0 means the sender does not use them
+static bool is_late(uint8_t sequence)
+{
+  if (sequence == 0 || last_sequence == 0)
+    return false;
+  uint8_t behind = (last_sequence - sequence) & 0x0F;
+  return behind > 0 && behind < 8;
+}
+
+static uint32_t read_be32(const uint8_t *bytes)
+{
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static RealtimeEvent handle_packet(int length, uint32_t *pixels, int count)
+{
+  uint8_t header[ddp_header_length];
+  if (length < ddp_header_length || hal_udp_read(header, ddp_header_length) != ddp_header_length)
+  {
+    stats.invalid++;
+    return REALTIME_EVENT_NONE;
+  }
+  uint8_t flags = header[0];
+  // Timecodes add four bytes to the header; they are read and ignored
+  int header_length = ddp_header_length;
+  if (flags & ddp_flag_timecode)
+  {
+    uint8_t timecode[4];
+    header_length += hal_udp_read(timecode, sizeof(timecode));
+  }
+  uint32_t offset = read_be32(header + 4);
+  int data_length = (header[8] << 8) | header[9];
+  if ((flags & ddp_version_mask) != ddp_version_1 || (flags & ddp_flag_query) || header[3] != ddp_id_display ||
+      data_length > length - header_length || offset % 3 != 0 || data_length % 3 != 0)
+  {
+    stats.invalid++;
+    return REALTIME_EVENT_NONE;
+  }
+  uint8_t sequence = header[1] & 0x0F;
+  if (is_late(sequence))
+  {
+    stats.late++;
+    return REALTIME_EVENT_NONE;
+  }
+  if (sequence != 0)
+    last_sequence = sequence;
+
+  int first = offset / 3;
+  int pixel_count = data_length / 3;
+  if (first + pixel_count > count)
+  {
+    stats.invalid++;
+    return REALTIME_EVENT_NONE;
+  }
+
+  // The RGB triplets are read into the end of their own slice of the frame
+  // buffer and widened to 0xRRGGBB front to back, so every source byte is
+  // consumed before the write position reaches it
+  uint32_t *target = pixels + first;
+  uint8_t *bytes = (uint8_t *)target + pixel_count;
+  if (hal_udp_read(bytes, data_length) != data_length)
+  {
+    stats.invalid++;
+    return REALTIME_EVENT_NONE;
+  }
+  for (int i = 0; i < pixel_count; i++)
+  {
+    const uint8_t *rgb = bytes + i * 3;
+    target[i] = pixel_color(rgb[0], rgb[1], rgb[2]);
+  }
+  return (flags & ddp_flag_push) ? REALTIME_EVENT_FRAME : REALTIME_EVENT_PIXELS;
+}
+
+static void complete_frame()
+{
+  if (frame_pending)
+    stats.dropped++;
+  frame_pending = true;
+}
+
+RealtimeEvent realtime_poll(uint32_t *pixels, int count)
+{
+  RealtimeEvent event = frame_completed ? REALTIME_EVENT_FRAME : REALTIME_EVENT_NONE;
+  frame_completed = false;
+  for (int i = 0; i < realtime_packets_per_frame; i++)
+  {
+    int length = hal_udp_parse();
+    if (length <= 0)
+      break;
+    stats.received++;
+    last_packet = hal_millis();
+    RealtimeEvent packet_event = handle_packet(length, pixels, count);
+    if (packet_event == REALTIME_EVENT_FRAME)
+      complete_frame();
+    if (packet_event > event)
+      event = packet_event;
+  }
+  return event;
+}
+
+bool realtime_decode_frame(const uint8_t *payload, int length, uint32_t *pixels, int count)
+{
+  stats.received++;
+  if (length == count * 3)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      const uint8_t *rgb = payload + i * 3;
+      pixels[i] = pixel_color(rgb[0], rgb[1], rgb[2]);
+    }
+  }
+  else
+  {
+    // Check the runs first so a bad payload leaves the frame untouched
+    int total = 0;
+    for (int i = 0; i + 4 <= length; i += 4)
+      total += payload[i];
+    if (length == 0 || length % 4 != 0 || total > count)
+    {
+      stats.invalid++;
+      return false;
+    }
+    uint32_t *pixel = pixels;
+    for (int i = 0; i < length; i += 4)
+    {
+      uint32_t color = pixel_color(payload[i + 1], payload[i + 2], payload[i + 3]);
+      for (int run = payload[i]; run > 0; run--)
+        *pixel++ = color;
+    }
+    while (pixel < pixels + count)
+      *pixel++ = 0;
+  }
+  last_packet = hal_millis();
+  complete_frame();
+  frame_completed = true;
+  return true;
+}
+
+void realtime_frame_shown()
+{
+  if (!frame_pending)
+    return;
+  frame_pending = false;
+  stats.shown++;
+}
+
+unsigned long realtime_last_packet()
+{
+  return last_packet;
+}
+
+const RealtimeStats &realtime_stats()
+{
+  return stats;
+}
@@ -0,0 +1,78 @@
+#include "segments.h"
+#include "hal.h"
+
+struct Segment
+{
+  int length;
+  Effect *effect;
+  // The effect lives here, so changing the layout never touches the heap
+  alignas(Effect) uint8_t storage[effect_storage_size];
+};
+
+static Segment segments[segment_max_count];
+static int segment_count = 0;
+
+bool segments_configure(const SegmentConfig *configs, int count)
+{
+  if (count < 0 || count > segment_max_count)
+    return false;
+  int total_length = 0;
+  for (int i = 0; i < count; i++)
+  {
+    const SegmentConfig &config = configs[i];
+    if (config.length < 1 || config.mode < MODE_NORMAL || config.mode > MODE_PROGRESS || config.brightness < 0 ||
+        config.brightness > 255)
+      return false;
+    total_length += config.length;
+  }
+  if (total_length > num_pixels)
+    return false;
+
+  for (int i = 0; i < count; i++)
+  {
+    const SegmentConfig &config = configs[i];
+    Segment &segment = segments[i];
+    segment.length = config.length;
+    segment.effect = effect_construct(config.mode, segment.storage);
+    segment.effect->set_parameter(PARAM_COLOR, config.color);
+    segment.effect->set_parameter(PARAM_SPEED, config.speed);
+    segment.effect->set_brightness(config.brightness);
+    segment.effect->init();
+  }
+  segment_count = count;
+  return true;
+}
+
+int segments_count()
+{
+  return segment_count;
+}
+
+void segments_set_parameter(EffectParameter parameter, int value)
+{
+  for (int i = 0; i < segment_count; i++)
+    segments[i].effect->set_parameter(parameter, value);
+}
+
+void segments_update(unsigned long dt)
+{
+  for (int i = 0; i < segment_count; i++)
+    segments[i].effect->update(dt);
+}
+
+void segments_render(uint32_t *pixels, int count)
+{
+  int start = 0;
+  for (int i = 0; i < segment_count && start < count; i++)
+  {
+    Segment &segment = segments[i];
+    int length = segment.length;
+    if (length > count - start)
+      length = count - start;
+    // Each effect draws its own slice, as if the slice were the whole strip
+    segment.effect->render(pixels + start, length);
+    start += length;
+  }
+  for (; start < count; start++)
+    pixels[start] = 0;
+}
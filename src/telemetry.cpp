@@ -0,0 +1,81 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "telemetry.h"
+
+struct SectionTiming
+{
+  uint32_t count;
+  uint32_t sum;
+  uint32_t max;
+  uint32_t buckets[histogram_buckets];
+};
+
+static const char *const section_names[section_count] = {"loop", "input", "render", "show", "mqtt", "callback"};
+
+static SectionTiming timings[section_count];
+static int8_t rssi_samples[rssi_history];
+static int rssi_count = 0;
+
+void telemetry_end(TelemetrySection section, uint32_t start)
+{
+  uint32_t us = (hal_cycle_count() - start) / hal_cycles_per_us();
+  SectionTiming &timing = timings[section];
+  timing.count++;
+  timing.sum += us;
+  if (us > timing.max)
+    timing.max = us;
+  int bucket = 0;
+  while (bucket < histogram_buckets - 1 && us >= histogram_bounds[bucket])
+    bucket++;
+  timing.buckets[bucket]++;
+}
+
+// snprintf_P that keeps track of the position and never runs past the end
+static void append(char *buffer, size_t size, size_t &length, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+static void append(char *buffer, size_t size, size_t &length, const char *format, ...)
+{
+  if (length >= size)
+    return;
+  va_list arguments;
+  va_start(arguments, format);
+  int written = vsnprintf_P(buffer + length, size - length, format, arguments);
+  va_end(arguments);
+  if (written > 0)
+    length += written;
+  if (length >= size)
+    length = size - 1;
+}
+
+size_t telemetry_format(char *buffer, size_t size)
+{
+  size_t length = 0;
+  for (int section = 0; section < section_count; section++)
+  {
+    const SectionTiming &timing = timings[section];
+    append(buffer, size, length, PSTR("%s\"%s\":{\"n\":%u,\"avg\":%u,\"max\":%u,\"hist\":["),
+           section > 0 ? "," : "", section_names[section], (unsigned int)timing.count,
+           (unsigned int)(timing.count ? timing.sum / timing.count : 0), (unsigned int)timing.max);
+    for (int bucket = 0; bucket < histogram_buckets; bucket++)
+      append(buffer, size, length, PSTR("%s%u"), bucket > 0 ? "," : "", (unsigned int)timing.buckets[bucket]);
+    append(buffer, size, length, PSTR("]}"));
+  }
+  memset(timings, 0, sizeof(timings));
+
+  if (rssi_count == rssi_history)
+    memmove(rssi_samples, rssi_samples + 1, rssi_history - 1);
+  else
+    rssi_count++;
+  rssi_samples[rssi_count - 1] = hal_wifi_rssi();
+  append(buffer, size, length, PSTR(",\"rssi\":["));
+  for (int i = 0; i < rssi_count; i++)
+    append(buffer, size, length, PSTR("%s%d"), i > 0 ? "," : "", rssi_samples[i]);
+
+  append(buffer, size, length,
+         PSTR("],\"heap_free\":%u,\"heap_max_block\":%u,\"heap_fragmentation\":%u,\"reset\":\"%s\""),
+         (unsigned int)hal_free_heap(), (unsigned int)hal_max_free_block(), (unsigned int)hal_heap_fragmentation(),
+         hal_reset_reason());
+  return length;
+}
@@ -0,0 +1,95 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "color.h"
+
+int hsv_to_rgb(float h, float s, float v);
+
+// The float implementation hsv_to_rgb() used before the fixed-point kernel
+static int hsv_to_rgb_reference(float h, float s, float v)
+{
+  h = fmod(h, 360);
+  if (h < 0)
+    h += 360;
+
+  s = constrain(s, 0, 1);
+  v = constrain(v, 0, 1);
+
+  float c = v * s;
+  float x = c * (1 - fabs(fmod(h / 60.0, 2) - 1));
+  float m = v - c;
+
+  float r_f, g_f, b_f;
+  if (h < 60)
+    r_f = c, g_f = x, b_f = 0;
+  else if (h < 120)
+    r_f = x, g_f = c, b_f = 0;
+  else if (h < 180)
+    r_f = 0, g_f = c, b_f = x;
+  else if (h < 240)
+    r_f = 0, g_f = x, b_f = c;
+  else if (h < 300)
+    r_f = x, g_f = 0, b_f = c;
+  else
+    r_f = c, g_f = 0, b_f = x;
+
+  uint8_t r = (r_f + m) * 255;
+  uint8_t g = (g_f + m) * 255;
+  uint8_t b = (b_f + m) * 255;
+
+  return r * 256 * 256 + g * 256 + b;
+}
+
+static int channel_error(int a, int b, int shift)
+{
+  return abs(((a >> shift) & 0xFF) - ((b >> shift) & 0xFF));
+}
+
+// Every whole degree of hue and every 1/255 step of saturation and value
+// stays within 1 of the float reference per channel
+static void test_hsv_to_rgb_matches_the_float_reference()
+{
+  const int max_allowed_error = 1;
+  int max_error = 0;
+  for (int h = 0; h < 360; h++)
+  {
+    for (int s = 0; s <= 255; s++)
+    {
+      for (int v = 0; v <= 255; v++)
+      {
+        int expected = hsv_to_rgb_reference(h, s / 255.0f, v / 255.0f);
+        int actual = hsv_to_rgb(h, s / 255.0f, v / 255.0f);
+        for (int shift = 0; shift <= 16; shift += 8)
+        {
+          int error = channel_error(expected, actual, shift);
+          if (error > max_error)
+            max_error = error;
+        }
+      }
+    }
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(max_allowed_error, max_error);
+}
+
+static void test_hsv_to_rgb_fixed_primaries()
+{
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, hsv_to_rgb_fixed(0, hsv_one, hsv_one));
+  TEST_ASSERT_EQUAL_HEX32(0x00FF00, hsv_to_rgb_fixed(21845, hsv_one, hsv_one));
+  TEST_ASSERT_EQUAL_HEX32(0x0000FF, hsv_to_rgb_fixed(43691, hsv_one, hsv_one));
+  TEST_ASSERT_EQUAL_HEX32(0xFFFFFF, hsv_to_rgb_fixed(12345, 0, hsv_one));
+  TEST_ASSERT_EQUAL_HEX32(0x000000, hsv_to_rgb_fixed(12345, hsv_one, 0));
+}
+
+// Hues that round up to a full circle come out as red
+static void test_hsv_to_rgb_wraps_the_hue()
+{
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, hsv_to_rgb(359.999f, 1, 1));
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, hsv_to_rgb(-0.001f, 1, 1));
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, hsv_to_rgb(720, 1, 1));
+}
+
+void run_color_tests()
+{
+  RUN_TEST(test_hsv_to_rgb_matches_the_float_reference);
+  RUN_TEST(test_hsv_to_rgb_fixed_primaries);
+  RUN_TEST(test_hsv_to_rgb_wraps_the_hue);
+}
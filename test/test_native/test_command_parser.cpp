@@ -0,0 +1,85 @@
+#include <string.h>
+#include <unity.h>
+#include "command_parser.h"
+
+static void test_parse_int_reads_signed_numbers()
+{
+  const char payload[] = " -42 +7 13";
+  const char *cursor = payload;
+  const char *end = payload + strlen(payload);
+  TEST_ASSERT_EQUAL(-42, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL(7, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL(13, parse_int(cursor, end));
+  TEST_ASSERT_TRUE(cursor == end);
+}
+
+static void test_parse_int_stops_at_the_end_of_the_payload()
+{
+  // Not null terminated, the digits after end belong to the next message
+  const char payload[] = "12345";
+  const char *cursor = payload;
+  TEST_ASSERT_EQUAL(123, parse_int(cursor, payload + 3));
+  TEST_ASSERT_TRUE(cursor == payload + 3);
+}
+
+static void test_parse_int_of_a_missing_number_is_zero()
+{
+  const char payload[] = "abc";
+  const char *cursor = payload;
+  TEST_ASSERT_EQUAL(0, parse_int(cursor, payload + 3));
+  TEST_ASSERT_TRUE(cursor == payload);
+}
+
+// Just above 2^31 and 2^32, which wrap in a 32-bit long without the check
+static void test_parse_int_saturates_long_numbers()
+{
+  const char payload[] = "2147483648 4294967297 -4294967297 99999999999999999999 1000000000 5";
+  const char *cursor = payload;
+  const char *end = payload + strlen(payload);
+  TEST_ASSERT_EQUAL_INT32(999999999, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL_INT32(999999999, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL_INT32(-999999999, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL_INT32(999999999, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL_INT32(999999999, parse_int(cursor, end));
+  TEST_ASSERT_EQUAL_INT32(5, parse_int(cursor, end));
+}
+
+static void test_parse_float_reads_fractions()
+{
+  const char payload[] = "25.5,-0.25";
+  const char *cursor = payload;
+  const char *end = payload + strlen(payload);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 25.5, parse_float(cursor, end));
+  TEST_ASSERT_TRUE(parse_skip(cursor, end, ','));
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, -0.25, parse_float(cursor, end));
+  TEST_ASSERT_FALSE(parse_skip(cursor, end, ','));
+}
+
+static void test_parse_starts_with_respects_the_end()
+{
+  const char payload[] = "rs 15";
+  TEST_ASSERT_TRUE(parse_starts_with(payload, payload + 5, "rs"));
+  TEST_ASSERT_FALSE(parse_starts_with(payload, payload + 1, "rs"));
+  TEST_ASSERT_FALSE(parse_starts_with(payload, payload + 5, "sps"));
+}
+
+static void test_parse_at_end_skips_blanks()
+{
+  const char payload[] = "7 \t ";
+  const char *cursor = payload;
+  const char *end = payload + strlen(payload);
+  TEST_ASSERT_FALSE(parse_at_end(cursor, end));
+  parse_int(cursor, end);
+  TEST_ASSERT_TRUE(parse_at_end(cursor, end));
+}
+
+void run_command_parser_tests()
+{
+  RUN_TEST(test_parse_int_reads_signed_numbers);
+  RUN_TEST(test_parse_int_stops_at_the_end_of_the_payload);
+  RUN_TEST(test_parse_int_of_a_missing_number_is_zero);
+  RUN_TEST(test_parse_int_saturates_long_numbers);
+  RUN_TEST(test_parse_float_reads_fractions);
+  RUN_TEST(test_parse_starts_with_respects_the_end);
+  RUN_TEST(test_parse_at_end_skips_blanks);
+}
@@ -0,0 +1,28 @@
+#include <unity.h>
+
+// Host unit tests, run with "pio test -e native". The firmware sources are
+// built into the test program (test_build_src), the simulator main() is
+// left out.
+
+void run_color_tests();
+void run_command_parser_tests();
+void run_realtime_tests();
+void run_table_tests();
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  run_color_tests();
+  run_command_parser_tests();
+  run_realtime_tests();
+  run_table_tests();
+  return UNITY_END();
+}
@@ -0,0 +1,42 @@
+#include <unity.h>
+#include "hal.h"
+#include "realtime.h"
+
+static void test_decode_raw_frame()
+{
+  uint8_t payload[num_pixels * 3];
+  for (int i = 0; i < num_pixels * 3; i++)
+    payload[i] = i;
+  uint32_t pixels[num_pixels];
+  TEST_ASSERT_TRUE(realtime_decode_frame(payload, sizeof(payload), pixels, num_pixels));
+  TEST_ASSERT_EQUAL_HEX32(0x000102, pixels[0]);
+  TEST_ASSERT_EQUAL_HEX32(pixel_color(255, 0, 1), pixels[num_pixels - 1]);
+}
+
+static void test_decode_runs_turn_off_the_rest_of_the_strip()
+{
+  uint32_t pixels[num_pixels];
+  for (int i = 0; i < num_pixels; i++)
+    pixels[i] = 0xFFFFFF;
+  const uint8_t payload[] = {2, 255, 0, 0, 3, 0, 0, 255};
+  TEST_ASSERT_TRUE(realtime_decode_frame(payload, sizeof(payload), pixels, num_pixels));
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, pixels[1]);
+  TEST_ASSERT_EQUAL_HEX32(0x0000FF, pixels[4]);
+  for (int i = 5; i < num_pixels; i++)
+    TEST_ASSERT_EQUAL_HEX32(0, pixels[i]);
+}
+
+static void test_decode_rejects_runs_past_the_strip()
+{
+  uint32_t pixels[num_pixels] = {0};
+  const uint8_t payload[] = {80, 255, 0, 0, 10, 0, 255, 0};
+  TEST_ASSERT_FALSE(realtime_decode_frame(payload, sizeof(payload), pixels, num_pixels));
+  TEST_ASSERT_EQUAL_HEX32(0, pixels[0]);
+}
+
+void run_realtime_tests()
+{
+  RUN_TEST(test_decode_raw_frame);
+  RUN_TEST(test_decode_runs_turn_off_the_rest_of_the_strip);
+  RUN_TEST(test_decode_rejects_runs_past_the_strip);
+}
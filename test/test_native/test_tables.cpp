@@ -0,0 +1,47 @@
+#include <math.h>
+#include <unity.h>
+#include "hal.h"
+#include "color.h"
+
+// calcRainbowColors(), which filled the rainbow table in RAM at boot
+static uint32_t rainbow_reference(int i)
+{
+  uint8_t WheelPos = 255 - i;
+  if (WheelPos < 85)
+    return pixel_color(255 - WheelPos * 3, 0, WheelPos * 3);
+  if (WheelPos < 170)
+  {
+    WheelPos -= 85;
+    return pixel_color(0, WheelPos * 3, 255 - WheelPos * 3);
+  }
+  WheelPos -= 170;
+  return pixel_color(WheelPos * 3, 255 - WheelPos * 3, 0);
+}
+
+static uint16_t gamma_reference(int i)
+{
+  return round(65535 * pow(i / 256.0, 2.2));
+}
+
+// The tables are generated at build time, every entry has to match the
+// runtime formula
+static void test_rainbow_table_matches_the_formula()
+{
+  for (int i = 0; i < 256; i++)
+    TEST_ASSERT_EQUAL_HEX32(rainbow_reference(i), rainbow_color(i));
+}
+
+static void test_gamma_table_matches_the_formula()
+{
+  for (int i = 0; i < 256; i++)
+    TEST_ASSERT_EQUAL_UINT16(gamma_reference(i), gamma_expand(i << 8));
+  // The last step interpolates towards the end point entry
+  TEST_ASSERT_EQUAL_UINT16(gamma_reference(255) + (((gamma_reference(256) - gamma_reference(255)) * 255) >> 8),
+                           gamma_expand(0xFFFF));
+}
+
+void run_table_tests()
+{
+  RUN_TEST(test_rainbow_table_matches_the_formula);
+  RUN_TEST(test_gamma_table_matches_the_formula);
+}
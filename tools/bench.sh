@@ -0,0 +1,10 @@
+#!/bin/sh
+# Builds the native simulator, runs all host benchmarks, writes the results
+# as CSV (default .pio/bench_results.csv) and fails if one regressed past
+# tools/bench_thresholds.txt.
+set -e
+cd "$(dirname "$0")/.."
+results="${1:-.pio/bench_results.csv}"
+pio run -e native
+printf "run 1000\nbench all\nbench save %s\nbench check tools/bench_thresholds.txt\n" "$results" |
+  .pio/build/native/program
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Streams a moving rainbow to the lamp over DDP (UDP port 4048).
+
+Usage: ddp_send.py [host] [--fps 40] [--seconds 10] [--pixels 86]
+
+Works against the lamp and against the native simulator, which listens on
+127.0.0.1.
+"""
+
+import argparse
+import colorsys
+import socket
+import time
+
+DDP_PORT = 4048
+DDP_VERSION_1 = 0x40
+DDP_PUSH = 0x01
+DDP_TYPE_RGB8 = 0x0B
+DDP_ID_DISPLAY = 1
+
+
+def ddp_packet(sequence, pixels):
+    data = bytes(channel for pixel in pixels for channel in pixel)
+    header = bytes([DDP_VERSION_1 | DDP_PUSH, sequence, DDP_TYPE_RGB8, DDP_ID_DISPLAY])
+    header += (0).to_bytes(4, "big") + len(data).to_bytes(2, "big")
+    return header + data
+
+
+def rainbow(frame, count):
+    pixels = []
+    for i in range(count):
+        r, g, b = colorsys.hsv_to_rgb(((i + frame) % count) / count, 1, 1)
+        pixels.append((int(r * 255), int(g * 255), int(b * 255)))
+    return pixels
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host", nargs="?", default="127.0.0.1")
+    parser.add_argument("--fps", type=float, default=40)
+    parser.add_argument("--seconds", type=float, default=10)
+    parser.add_argument("--pixels", type=int, default=86)
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    frames = int(args.fps * args.seconds)
+    for frame in range(frames):
+        sequence = frame % 15 + 1
+        sock.sendto(ddp_packet(sequence, rainbow(frame, args.pixels)), (args.host, DDP_PORT))
+        time.sleep(1 / args.fps)
+    print(f"sent {frames} frames")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,70 @@
+# PlatformIO post-build script for the d1_mini: prints the sections that
+# take the 80 KB DRAM of the ESP8266 (.data, .rodata, .bss) and estimates
+# the heap they leave. If tools/ram_baseline.txt exists, the change against
+# it is printed as well; "pio run -e d1_mini -t ram_baseline" stores the
+# current sizes as the new baseline.
+#
+# The figures are estimates from the linker sections only. The SDK and the
+# system stack take DRAM that is not in them, so the real heap is smaller.
+# The heap actually free at idle is measured on the device and published as
+# heap_free on the <root>/stats topic.
+import os
+import subprocess
+
+Import("env")
+
+dram_size = 81920
+sections = (".data", ".rodata", ".bss")
+baseline_path = os.path.join(env.subst("$PROJECT_DIR"), "tools", "ram_baseline.txt")
+elf_path = "$BUILD_DIR/${PROGNAME}.elf"
+
+
+def read_sections(elf):
+    output = subprocess.check_output([env.subst("$SIZETOOL"), "-A", elf], universal_newlines=True)
+    sizes = dict.fromkeys(sections, 0)
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] in sizes:
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def read_baseline():
+    if not os.path.exists(baseline_path):
+        return None
+    baseline = {}
+    with open(baseline_path) as file:
+        for line in file:
+            fields = line.split()
+            if len(fields) == 2 and not line.startswith("#"):
+                baseline[fields[0]] = int(fields[1])
+    return baseline
+
+
+def ram_report(source, target, env):
+    sizes = read_sections(env.subst(elf_path))
+    baseline = read_baseline()
+    total = sum(sizes.values())
+    print("DRAM usage, estimated from the ELF sections:")
+    for name in sections + ("total",):
+        size = total if name == "total" else sizes[name]
+        change = ""
+        if baseline and name in baseline:
+            change = " (%+d)" % (size - baseline[name])
+        print("  %-8s %6d bytes%s" % (name, size, change))
+    print("  heap before setup() estimated at most %d bytes, see heap_free on <root>/stats" % (dram_size - total))
+
+
+def ram_baseline(source, target, env):
+    sizes = read_sections(env.subst(elf_path))
+    with open(baseline_path, "w") as file:
+        file.write("# DRAM sections of the d1_mini build, written by tools/ram_report.py\n")
+        for name in sections:
+            file.write("%s %d\n" % (name, sizes[name]))
+        file.write("total %d\n" % sum(sizes.values()))
+    print("Stored the RAM baseline in %s" % baseline_path)
+
+
+env.AddPostAction(elf_path, ram_report)
+env.AddCustomTarget("ram_baseline", elf_path, ram_baseline, title="RAM baseline",
+                    description="Store the current DRAM sections as baseline")